@@ -22,7 +22,6 @@
  */
 
 #include <modem_xfer.h>
-#include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
@@ -31,30 +30,126 @@
 #include "modem_xfer_debug.h"
 
 int modem_xfer_discard(void)
+{
+    return modem_xfer_discard_poll(NULL);
+}
+
+int modem_xfer_discard_poll(volatile uint8_t *cancel)
 {
     int res = 0;
     uint8_t rxb;
     uint8_t tmp[16];
-    while (modem_xfer_rx(&rxb, 300) == 1) {
+    // a line that never goes quiet must not keep us here forever
+    uint32_t deadline = modem_xfer_clock_ms() + MODEM_XFER_DISCARD_MS;
+
+    while (modem_xfer_rx_poll(&rxb, modem_xfer_clock_ms() + 300, cancel) == 1) {
         if (res < sizeof(tmp)) {
             tmp[res] = rxb;
         }
         res++;
+        if (modem_xfer_expired(deadline)) {
+            break;
+        }
     }
     modem_xfer_hex_dump(MODEM_XFER_LOG_DEBUG, tmp, sizeof(tmp));
 
     return res;
 }
 
-int modem_xfer_recv_bytes(uint8_t *buf, int n, int timeout_ms)
+int modem_xfer_expired(uint32_t deadline_ms)
+{
+    return (int32_t)(deadline_ms - modem_xfer_clock_ms()) <= 0;
+}
+
+/*
+ * Time to shift n bytes with 8N1 framing at the given baud rate, rounded up
+ */
+uint32_t modem_xfer_frame_ms(uint32_t baud, unsigned int n)
+{
+    if (baud == 0) {
+        return 0;
+    }
+
+    return ((uint32_t)n * 10 * 1000 + baud - 1) / baud;
+}
+
+/*
+ * Receive a byte by an absolute deadline. If cancel is given, the wait is
+ * sliced into MODEM_XFER_POLL_MS intervals and ends as soon as *cancel is set,
+ * which another thread or an ISR may do at any time.
+ */
+int modem_xfer_rx_poll(uint8_t *c, uint32_t deadline_ms, volatile uint8_t *cancel)
+{
+    int res;
+    int32_t remain;
+
+    do {
+        if (cancel != NULL && *cancel) {
+            return 0;
+        }
+        remain = (int32_t)(deadline_ms - modem_xfer_clock_ms());
+        if (remain < 0) {
+            remain = 0;
+        }
+        if (cancel != NULL && MODEM_XFER_POLL_MS < remain) {
+            remain = MODEM_XFER_POLL_MS;
+        }
+        res = modem_xfer_rx(c, remain);
+        if (res != 0) {
+            return res;
+        }
+    } while (!modem_xfer_expired(deadline_ms));
+
+    return 0;
+}
+
+/*
+ * Receive n bytes, giving up at an absolute deadline of modem_xfer_clock_ms(),
+ * so the total time is bounded however the bytes trickle in. Bytes which have
+ * already arrived are still picked up after the deadline.
+ */
+int modem_xfer_recv_bytes_poll(uint8_t *buf, int n, uint32_t deadline_ms,
+                               volatile uint8_t *cancel)
 {
     int i;
     int res;
 
+    #ifdef MODEM_XFER_RX_BYTES
+    /*
+     * The port hands over everything it has buffered, up to n bytes, per call of
+     * modem_xfer_rx_bytes(), e.g. from a modem_xfer_ring. It returns as soon as
+     * there is at least a byte, or 0 when timeout_ms has passed.
+     */
+    int32_t remain;
+
+    i = 0;
+    while (i < n) {
+        if (cancel != NULL && *cancel) {
+            break;
+        }
+        remain = (int32_t)(deadline_ms - modem_xfer_clock_ms());
+        if (remain < 0) {
+            remain = 0;
+        }
+        if (cancel != NULL && MODEM_XFER_POLL_MS < remain) {
+            remain = MODEM_XFER_POLL_MS;
+        }
+        res = modem_xfer_rx_bytes(&buf[i], n - i, remain);
+        if (res < 0) {
+            return res;
+        }
+        i += res;
+        if (res == 0 && modem_xfer_expired(deadline_ms)) {
+            break;
+        }
+    }
+
+    return i;
+    #else
     for (i = 0; i < n; i++) {
-        res = modem_xfer_rx(&buf[i], timeout_ms);
+        res = modem_xfer_rx_poll(&buf[i], deadline_ms, cancel);
         if (res == 0) {
-            //  time out (there might be no sender)
+            //  time out (there might be no sender) or canceled
             return i;
         }
         if (res < 0) {
@@ -64,8 +159,20 @@ int modem_xfer_recv_bytes(uint8_t *buf, int n, int timeout_ms)
     }
 
     return i;
+    #endif
+}
+
+int modem_xfer_recv_bytes_until(uint8_t *buf, int n, uint32_t deadline_ms)
+{
+    return modem_xfer_recv_bytes_poll(buf, n, deadline_ms, NULL);
 }
 
+int modem_xfer_recv_bytes(uint8_t *buf, int n, int timeout_ms)
+{
+    return modem_xfer_recv_bytes_until(buf, n, modem_xfer_clock_ms() + timeout_ms);
+}
+
+#ifndef MODEM_XFER_NO_HEXDUMP
 void modem_xfer_hex_dump(int log_level, uint8_t *buf, int n)
 {
     int i;
@@ -76,6 +183,13 @@ void modem_xfer_hex_dump(int log_level, uint8_t *buf, int n)
     }
     #endif
 
+    #ifdef MODEM_XFER_TRACE
+    for (i = 0; i + 16 <= n; i += 16) {
+        modem_xfer_trace_hex(log_level, (uint16_t)i, &buf[i]);
+    }
+    return;
+    #endif
+
     for (i = 0; i < n; i += 16) {
         modem_xfer_printf(log_level, "%04X: "
             "%02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X "
@@ -93,6 +207,7 @@ void modem_xfer_hex_dump(int log_level, uint8_t *buf, int n)
             isprint(buf[i+14]) ? buf[i+14] : '.', isprint(buf[i+15]) ? buf[i+15] : '.');
     }
 }
+#endif  // MODEM_XFER_NO_HEXDUMP
 
 uint16_t modem_xfer_crc16(uint16_t crc, const void *buf, unsigned int count)
 {
@@ -109,3 +224,88 @@ uint16_t modem_xfer_crc16(uint16_t crc, const void *buf, unsigned int count)
 
     return crc;
 }
+
+/*
+ * Tiny integer codecs, so that the header handling doesn't need stdio
+ */
+int modem_xfer_utoa(char *buf, uint32_t val)
+{
+    char tmp[10];
+    int i = 0, n = 0;
+
+    do {
+        tmp[i++] = '0' + (val % 10);
+        val /= 10;
+    } while (val != 0);
+    while (0 < i) {
+        buf[n++] = tmp[--i];
+    }
+    buf[n] = '\0';
+
+    return n;
+}
+
+int modem_xfer_utox(char *buf, uint32_t val, int digits)
+{
+    int i;
+
+    for (i = 0; i < digits; i++) {
+        buf[i] = "0123456789abcdef"[(val >> ((digits - 1 - i) * 4)) & 0x0f];
+    }
+    buf[i] = '\0';
+
+    return i;
+}
+
+int modem_xfer_atou(const char *s, uint32_t *val)
+{
+    const char *p = s;
+    uint32_t v = 0;
+
+    while (*p == ' ') {
+        p++;
+    }
+    if (*p < '0' || '9' < *p) {
+        return 0;
+    }
+    while ('0' <= *p && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+    }
+    *val = v;
+
+    return p - s;
+}
+
+int modem_xfer_xtou(const char *s, uint32_t *val)
+{
+    const char *p = s;
+    uint32_t v = 0;
+
+    for ( ; ; p++) {
+        if ('0' <= *p && *p <= '9') {
+            v = (v << 4) | (*p - '0');
+        } else
+        if ('a' <= (*p | 0x20) && (*p | 0x20) <= 'f') {
+            v = (v << 4) | ((*p | 0x20) - 'a' + 10);
+        } else {
+            break;
+        }
+    }
+    if (p != s) {
+        *val = v;
+    }
+
+    return p - s;
+}
+
+/*
+ * A name the peer sent may only name a file in the current directory
+ */
+int modem_xfer_name_ok(const char *name)
+{
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+
+    return strchr(name, '/') == NULL && strchr(name, '\\') == NULL;
+}
@@ -26,7 +26,55 @@
 
 #include <stdint.h>
 
+/*
+ * Footprint profile. MODEM_XFER_MINIMAL drops logging, the hex dump and the
+ * per-file digests; MODEM_XFER_NO_SEND or MODEM_XFER_NO_RECEIVE additionally
+ * drop the unused direction.
+ */
+#ifdef MODEM_XFER_MINIMAL
+#ifndef MODEM_XFER_NO_LOG
+#define MODEM_XFER_NO_LOG
+#endif
+#ifndef MODEM_XFER_NO_HEXDUMP
+#define MODEM_XFER_NO_HEXDUMP
+#endif
+#ifndef MODEM_XFER_NO_DIGEST
+#define MODEM_XFER_NO_DIGEST
+#endif
+#endif  // MODEM_XFER_MINIMAL
+
+#ifndef MODEM_XFER_TRACE_SIZE
+#define MODEM_XFER_TRACE_SIZE 64
+#endif
+#define MODEM_XFER_TRACE_ARGS 4
+#ifndef MODEM_XFER_TRACE_STR
+#define MODEM_XFER_TRACE_STR 20  // bytes of string arguments kept per event
+#endif
+#define MODEM_XFER_TRACE_HEX_ID 0xffff
+#define MODEM_XFER_TRACE_HEADER_SIZE 12
+#define MODEM_XFER_TRACE_EVENT_SIZE (12 + 4 * MODEM_XFER_TRACE_ARGS + MODEM_XFER_TRACE_STR)
+// log formats are collected here, so that an event id is the offset of its format
+#ifdef __APPLE__
+#define MODEM_XFER_TRACE_SECTION "__TEXT,__mxt_fmt"
+#else
+#define MODEM_XFER_TRACE_SECTION "modem_xfer_trace_fmt"
+#endif
+#define MODEM_XFER_CAPTURE_TX 0x00
+#define MODEM_XFER_CAPTURE_RX 0x80
+
 #define MODEM_XFER_BUF_SIZE 128
+#ifndef MODEM_XFER_BAUD
+#define MODEM_XFER_BAUD 300  // slowest line assumed for frame deadlines unless ctx->baud is set
+#endif
+#define MODEM_XFER_DISCARD_MS 3000
+#ifndef MODEM_XFER_REQ_POLL_MS
+#define MODEM_XFER_REQ_POLL_MS 1000  // interval of the receiver's start byte, as rz does
+#endif
+#define MODEM_XFER_REQ_WAIT_MS 25000  // how long a receiver waits for a sender, at most poll_ms
+#define MODEM_XFER_FAST_POLL_MS 100  // the same once both peers agreed on YMODEM_CAP_FAST_POLL
+#ifndef MODEM_XFER_POLL_MS
+#define MODEM_XFER_POLL_MS 20  // worst-case latency of ymodem_request_cancel()
+#endif
 #define MODEM_XFER_UNKNOWN_FILE_SIZE ((uint32_t)0xffffffff)
 
 enum {
@@ -51,37 +99,346 @@ enum {
     MODEM_XFER_RES_EIO,
     MODEM_XFER_RES_EPTOROCOL,
     MODEM_XFER_RES_ESEQUENCE,
+    MODEM_XFER_RES_ENOMEM,
+};
+
+#define YMODEM_FLAG_EOF_BLOCK   0x01  // report the end of each file as a zero-length block
+#define YMODEM_FLAG_PEER_CRC32  0x02  // peer_crc32 holds the digest advertised by the sender
+#define YMODEM_FLAG_DELTA       0x04  // offer (sender) or accept (receiver) delta transfer
+#define YMODEM_FLAG_DELTA_ACTIVE 0x08 // delta transfer is in use for the current file
+#define YMODEM_FLAG_PACK        0x10  // accept packed batches (receiver)
+#define YMODEM_FLAG_PACK_ACTIVE 0x20  // the current file is a packed batch
+#define YMODEM_FLAG_CAN_SENT    0x40  // CAN CAN has been sent for a requested cancel
+#define YMODEM_FLAG_CAPS        0x80  // the current header carries a caps token
+
+/*
+ * Capabilities. The sender advertises its set as "caps=xx" in the block 0
+ * extension and a receiver which understands it answers with a start byte of
+ * 0x80 | (common set) instead of 'C', so classic peers never see either.
+ * Delta and crc32 have header tokens of their own, and so has a packed batch,
+ * which is only sent once the receiver agreed on YMODEM_CAP_PACK.
+ */
+#define YMODEM_CAP_FAST_POLL 0x01  // start bytes every MODEM_XFER_FAST_POLL_MS
+#define YMODEM_CAP_PACK      0x02  // packed batches, offered by a receiver with YMODEM_FLAG_PACK
+
+#define YMODEM_SYNC_NONE  0  // durability policy: leave write-back to the OS
+#define YMODEM_SYNC_FILE  1  // sync each file before it replaces the old copy
+#define YMODEM_SYNC_GROUP 2  // also sync every sync_bytes or sync_ms of a file
+
+#define MODEM_XFER_COMMIT_BEGIN 0x01  // the following saves go to a new copy, loads still read the file
+#define MODEM_XFER_COMMIT_SYNC  0x02  // make what has been saved durable
+#define MODEM_XFER_COMMIT_END   0x04  // the new copy is complete, replace the file with it
+#define MODEM_XFER_COMMIT_ABORT 0x08  // the new copy is incomplete, drop it
+
+#define YMODEM_FEC_MAX_PARITY 32  // parity bytes per frame, 2 for each correctable byte
+#define YMODEM_FEC_PARITY 8       // what a receiver accepts unless told otherwise
+
+#define YMODEM_DELTA_CHUNK 1024
+#ifdef MODEM_XFER_SHA256
+#define YMODEM_DELTA_SIG_SIZE 20  // room for a signature of either kind
+#else
+#define YMODEM_DELTA_SIG_SIZE 8
+#endif
+
+#define YMODEM_PACK_NAME_MAX 12  // longest member name, as long as a file name in a header
+
+enum {
+    YMODEM_DIGEST_NONE,
+    YMODEM_DIGEST_OK,
+    YMODEM_DIGEST_MISMATCH,
 };
 
 typedef struct {
-    uint8_t stat;
-    uint8_t seqno;
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+} modem_xfer_sha256;
+
+typedef struct {
+    uint8_t state;
+    uint8_t len;
+    uint8_t pos;
+    char name[YMODEM_PACK_NAME_MAX + 1];
+    uint32_t size;
+    uint32_t offset;
+} ymodem_pack;
+
+/*
+ * Fixed-size frame buffers shared by many sessions, see modem_xfer_pool.c
+ */
+#define MODEM_XFER_POOL_CACHE 8  // buffers a thread keeps before returning them to the pool
+#define MODEM_XFER_POOL_MEM_SIZE(num_bufs, buf_size) \
+    ((uint32_t)(num_bufs) * ((buf_size) + sizeof(uint16_t)))
+
+typedef struct {
+    uint8_t *mem;
+    uint16_t *next;          // free list links, apart from the buffers they link
+    uint32_t head;           // free list: ABA tag << 16 | index of the first buffer
+    uint32_t num_out;        // buffers not on the free list, thread caches included
+    uint32_t high_water;     // the largest num_out so far
+    uint32_t num_exhausted;  // acquires which found no buffer
+    uint16_t num_bufs;
+    uint16_t buf_size;
+} modem_xfer_pool;
+
+typedef struct {
+    modem_xfer_pool *pool;
+    uint32_t num_hits;       // acquires served without touching the pool
+    uint16_t num;
+    uint16_t bufs[MODEM_XFER_POOL_CACHE];
+} modem_xfer_pool_cache;
+
+/*
+ * Lock-free byte ring from a receive ISR to the engine, see modem_xfer_ring.c
+ */
+typedef struct {
+    uint8_t *mem;
+    uint32_t num_overruns;  // bytes dropped because the ring was full
+    uint16_t mask;          // size - 1
+    uint16_t head;          // bytes ever put, written by the producer only
+    uint16_t tail;          // bytes ever taken, written by the consumer only
+    uint16_t high_water;    // the most bytes ever waiting
+} modem_xfer_ring;
+
+/*
+ * Members are ordered by decreasing alignment so that the context has no
+ * internal padding on 8, 16 and 32-bit targets.
+ */
+typedef struct {
     uint8_t *buf;
-    int num_files_xfered;
-    char file_name[13];
+    #ifdef MODEM_XFER_POOL
+    modem_xfer_pool *pool;              // buf is borrowed per frame when set
+    modem_xfer_pool_cache *pool_cache;  // of the thread running the session, or NULL
+    #endif
     uint32_t file_offset;
-    unsigned long file_size;
+    uint32_t file_size;
     uint32_t num_bytes_xfered;
+    uint32_t baud;
+    uint32_t num_dup_frames;  // frames repeated by the sender because our ACK was lost
+    #ifndef MODEM_XFER_NO_DIGEST
+    uint32_t file_crc32;
+    uint32_t peer_crc32;
+    #endif
+    #ifdef MODEM_XFER_SHA256
+    modem_xfer_sha256 file_sha256;
+    #endif
+    #ifdef MODEM_XFER_DELTA
+    uint8_t *delta_sigs;
+    uint32_t delta_sigs_size;
+    uint32_t delta_num_sigs;
+    uint16_t delta_skip;
+    uint8_t delta_sig_type;  // DELTA_SIG_* of the signatures from the receiver
+    #endif
+    #ifdef MODEM_XFER_PACK
+    ymodem_pack pack;
+    #endif
+    #ifdef MODEM_XFER_FEC
+    uint32_t fec_corrected;  // bytes repaired by the receiver
+    uint32_t fec_failed;     // frames beyond repair
+    #endif
+    #ifdef MODEM_XFER_DURABLE
+    uint32_t sync_bytes;    // YMODEM_SYNC_GROUP: bytes between syncs, 0 for no limit
+    uint32_t sync_pending;  // bytes saved since the last sync
+    uint32_t sync_last_ms;
+    uint16_t sync_ms;       // YMODEM_SYNC_GROUP: ms between syncs, 0 for no limit
+    uint8_t sync_policy;    // YMODEM_SYNC_*
+    uint8_t sync_stat;
+    #endif
+    uint16_t num_files_xfered;
+    uint16_t poll_ms;  // interval of the receiver's start byte
+    uint8_t caps;      // YMODEM_CAP_* offered by this side
+    uint8_t peer_caps; // YMODEM_CAP_* agreed with the peer, 0 for a classic peer
+    uint8_t stat;
+    uint8_t seqno;
+    uint8_t flags;
+    uint8_t digest_stat;
+    #ifdef MODEM_XFER_FEC
+    uint8_t fec_parity;  // parity bytes offered (sender) or accepted at most (receiver)
+    uint8_t fec_active;  // parity bytes per data frame of the current file, 0 if none
+    #endif
+    volatile uint8_t cancel_req;  // set by ymodem_request_cancel()
+    char file_name[13];
 } ymodem_context;
 
+typedef struct {
+    uint32_t timestamp;
+    uint16_t id;    // offset of the format in the format table, or MODEM_XFER_TRACE_HEX_ID
+    uint16_t aux;   // offset of a hex dump line
+    uint8_t log_level;
+    uint8_t nargs;
+    uint8_t strs;   // bit n is set if args[n] is the offset of a string in str
+    uint8_t reserved;
+    uint32_t args[MODEM_XFER_TRACE_ARGS];
+    char str[MODEM_XFER_TRACE_STR];
+} modem_xfer_trace_event;
+
+typedef struct {
+    int (*write)(void *arg, const uint8_t *buf, unsigned int n);
+    void *arg;
+    int res;
+    uint32_t last_ms;
+    uint32_t chunk_ms;
+    uint8_t dir;
+    uint8_t len;
+    uint8_t chunk[128];
+} modem_xfer_capture;
+
+typedef struct {
+    int (*read)(void *arg, uint8_t *buf, unsigned int n);
+    void *arg;
+    uint32_t now;
+    uint32_t rec_ms;
+    uint32_t num_tx_mismatches;
+    uint8_t eof;
+    uint8_t dir;
+    uint8_t len;
+    uint8_t pos;
+    uint8_t chunk[128];
+} modem_xfer_replay;
+
+#define YMODEM_FRAME_CACHE_SLOT (MODEM_XFER_BUF_SIZE + 2)
+#define YMODEM_FRAME_CACHE_SIZE(size) \
+    ((1 + ((uint32_t)(size) + MODEM_XFER_BUF_SIZE - 1) / MODEM_XFER_BUF_SIZE) * \
+     YMODEM_FRAME_CACHE_SLOT)
+
+typedef struct {
+    uint8_t *mem;
+    uint32_t max_frames;
+    uint32_t num_frames;
+    uint32_t file_size;
+    uint32_t num_bytes;
+    uint32_t file_crc32;
+    int refcount;
+    uint8_t finished;
+} ymodem_frame_cache;
+
 extern int ymodem_receive(uint8_t buf[MODEM_XFER_BUF_SIZE]);
+extern int ymodem_receive_ctx(ymodem_context *ctx);
 extern void ymodem_receive_init(ymodem_context *ctx, uint8_t buf[MODEM_XFER_BUF_SIZE]);
 extern int ymodem_receive_block(ymodem_context *ctx, unsigned int *sizep);
+extern void ymodem_receive_pool(ymodem_context *ctx, modem_xfer_pool *pool,
+                                modem_xfer_pool_cache *cache);
 
 extern void ymodem_send_init(ymodem_context *ctx, uint8_t buf[MODEM_XFER_BUF_SIZE]);
 extern int ymodem_send_header(ymodem_context *ctx, char *file_name, uint32_t size);
+extern int ymodem_send_header_crc32(ymodem_context *ctx, char *file_name, uint32_t size,
+                                    uint32_t crc32);
 extern int ymodem_send_block(ymodem_context *ctx);
 extern int ymodem_send_end(ymodem_context *ctx);
 extern void ymodem_send_cancel(ymodem_context *ctx);
+extern void ymodem_send_cancel_nowait(ymodem_context *ctx);
+extern void ymodem_request_cancel(ymodem_context *ctx);
+extern void ymodem_set_fec(ymodem_context *ctx, uint8_t nparity);
+extern void ymodem_send_delta_init(ymodem_context *ctx, uint8_t *sigs, uint32_t size);
+extern int ymodem_send_delta_chunk(ymodem_context *ctx, const uint8_t *data, unsigned int n);
+
+extern uint32_t ymodem_pack_entry_size(const char *file_name, uint32_t size);
+extern int ymodem_send_pack_begin(ymodem_context *ctx, char *pack_name, uint32_t size);
+extern int ymodem_send_pack_file(ymodem_context *ctx, char *file_name, uint32_t size);
+extern int ymodem_send_pack_data(ymodem_context *ctx, const uint8_t *data, unsigned int n);
+extern int ymodem_send_pack_end(ymodem_context *ctx);
+extern int ymodem_unpack(ymodem_context *ctx, uint8_t *buf, unsigned int n);
+extern int ymodem_unpack_end(ymodem_context *ctx);
+
+extern void ymodem_set_sync(ymodem_context *ctx, uint8_t policy, uint32_t group_bytes,
+                            uint16_t group_ms);
+extern int ymodem_commit(ymodem_context *ctx, unsigned int n);
+extern void ymodem_commit_abort(ymodem_context *ctx);
+
+extern int ymodem_frame_cache_init(ymodem_frame_cache *cache, uint8_t *mem, uint32_t mem_size,
+                                   char *file_name, uint32_t size);
+extern int ymodem_frame_cache_append(ymodem_frame_cache *cache, const uint8_t *data,
+                                     unsigned int n);
+extern int ymodem_frame_cache_finish(ymodem_frame_cache *cache);
+extern void ymodem_frame_cache_get(ymodem_frame_cache *cache);
+extern int ymodem_frame_cache_put(ymodem_frame_cache *cache);
+extern int ymodem_send_cached_file(ymodem_context *ctx, ymodem_frame_cache *cache);
+
+extern int modem_xfer_pool_init(modem_xfer_pool *pool, uint8_t *mem, uint32_t mem_size,
+                                uint16_t buf_size);
+extern uint8_t *modem_xfer_pool_acquire(modem_xfer_pool *pool, modem_xfer_pool_cache *cache);
+extern void modem_xfer_pool_release(modem_xfer_pool *pool, modem_xfer_pool_cache *cache,
+                                    uint8_t *buf);
+extern void modem_xfer_pool_cache_init(modem_xfer_pool_cache *cache, modem_xfer_pool *pool);
+extern void modem_xfer_pool_cache_flush(modem_xfer_pool_cache *cache);
+
+extern int modem_xfer_ring_init(modem_xfer_ring *ring, uint8_t *mem, uint16_t size);
+extern int modem_xfer_ring_put(modem_xfer_ring *ring, uint8_t c);
+extern unsigned int modem_xfer_ring_put_bytes(modem_xfer_ring *ring, const uint8_t *buf,
+                                              unsigned int n);
+extern unsigned int modem_xfer_ring_count(modem_xfer_ring *ring);
+extern unsigned int modem_xfer_ring_drain(modem_xfer_ring *ring, uint8_t *buf, unsigned int n);
+
+extern void modem_xfer_fec_encode(const uint8_t *payload, unsigned int n, const uint8_t crc[2],
+                                  uint8_t *parity, unsigned int nparity);
+extern int modem_xfer_fec_correct(uint8_t *payload, unsigned int n, uint8_t crc[2],
+                                  uint8_t *parity, unsigned int nparity);
 
 extern int modem_xfer_discard(void);
+extern int modem_xfer_discard_poll(volatile uint8_t *cancel);
+extern int modem_xfer_rx_poll(uint8_t *c, uint32_t deadline_ms, volatile uint8_t *cancel);
 extern int modem_xfer_recv_bytes(uint8_t *buf, int n, int timeout_ms);
+extern int modem_xfer_recv_bytes_until(uint8_t *buf, int n, uint32_t deadline_ms);
+extern int modem_xfer_recv_bytes_poll(uint8_t *buf, int n, uint32_t deadline_ms,
+                                      volatile uint8_t *cancel);
+extern int modem_xfer_expired(uint32_t deadline_ms);
+extern uint32_t modem_xfer_frame_ms(uint32_t baud, unsigned int n);
+#ifdef MODEM_XFER_NO_HEXDUMP
+#define modem_xfer_hex_dump(log_level, buf, n) do { (void)(buf); (void)(n); } while (0)
+#else
 extern void modem_xfer_hex_dump(int log_level, uint8_t *buf, int n);
+#endif
 extern uint16_t modem_xfer_crc16(uint16_t crc, const void *buf, unsigned int count);
+extern uint32_t modem_xfer_crc32(uint32_t crc, const void *buf, unsigned int count);
+extern void modem_xfer_sha256_init(modem_xfer_sha256 *sha);
+extern void modem_xfer_sha256_update(modem_xfer_sha256 *sha, const void *buf, unsigned int count);
+extern void modem_xfer_sha256_final(const modem_xfer_sha256 *sha, uint8_t digest[32]);
+#ifdef MODEM_XFER_NO_DIGEST
+#define modem_xfer_digest_reset(ctx) do { (void)(ctx); } while (0)
+#define modem_xfer_digest_update(ctx, buf, n) do { (void)(ctx); (void)(buf); (void)(n); } while (0)
+#else
+extern void modem_xfer_digest_reset(ymodem_context *ctx);
+extern void modem_xfer_digest_update(ymodem_context *ctx, const uint8_t *buf, unsigned int n);
+#endif
+extern int modem_xfer_utoa(char *buf, uint32_t val);
+extern int modem_xfer_utox(char *buf, uint32_t val, int digits);
+extern int modem_xfer_atou(const char *s, uint32_t *val);
+extern int modem_xfer_xtou(const char *s, uint32_t *val);
+extern int modem_xfer_name_ok(const char *name);
 extern int modem_xfer_tx(uint8_t);
 extern int modem_xfer_rx(uint8_t *, int timeout_ms);
+extern int modem_xfer_rx_bytes(uint8_t *buf, int n, int timeout_ms);  // MODEM_XFER_RX_BYTES only
 extern int modem_xfer_save(char*, uint32_t, uint8_t*, uint16_t);
+extern int modem_xfer_load(char*, uint32_t, uint8_t*, uint16_t);
+extern int modem_xfer_commit(char *file_name, uint8_t op);  // MODEM_XFER_DURABLE only
 extern void modem_xfer_printf(int log_level, const char *format, ...)
     __attribute__ ((format (printf, 2, 3)));
+extern uint32_t modem_xfer_clock_ms(void);
+
+extern void modem_xfer_trace_record(int log_level, const char *fmt, int strs, int nargs,
+                                    intptr_t a0, intptr_t a1, intptr_t a2, intptr_t a3);
+extern void modem_xfer_trace_hex(int log_level, uint16_t offset, const uint8_t *buf);
+extern int modem_xfer_trace_read(modem_xfer_trace_event *ev);
+extern int modem_xfer_trace_render(const modem_xfer_trace_event *ev, char *buf, unsigned int size);
+extern uint32_t modem_xfer_trace_lost(void);
+extern void modem_xfer_trace_dump(void);
+extern int modem_xfer_trace_save(int (*write)(void *arg, const uint8_t *buf, unsigned int n),
+                                 void *arg);
+extern int modem_xfer_trace_decode(const uint8_t buf[MODEM_XFER_TRACE_EVENT_SIZE],
+                                   modem_xfer_trace_event *ev);
+extern int modem_xfer_trace_format(const char *fmts, uint32_t fmts_size,
+                                   const modem_xfer_trace_event *ev, char *buf, unsigned int size);
+
+extern int modem_xfer_capture_start(modem_xfer_capture *cap,
+                                    int (*write)(void *arg, const uint8_t *buf, unsigned int n),
+                                    void *arg);
+extern int modem_xfer_capture_bytes(modem_xfer_capture *cap, uint8_t dir, const uint8_t *buf,
+                                    unsigned int n);
+extern int modem_xfer_capture_flush(modem_xfer_capture *cap);
+extern int modem_xfer_replay_start(modem_xfer_replay *rp,
+                                   int (*read)(void *arg, uint8_t *buf, unsigned int n),
+                                   void *arg);
+extern int modem_xfer_replay_rx(modem_xfer_replay *rp, uint8_t *c, int timeout_ms);
+extern void modem_xfer_replay_tx(modem_xfer_replay *rp, uint8_t c);
 
 #endif  // __MODEM_XFER_H__
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <string.h>
+
+/*
+ * Link traffic capture
+ *
+ * A capture starts with an 8 byte file header followed by records:
+ *
+ *   +--------+-----------+------------------+
+ *   | dir|n  | dt_ms     | n + 1 data bytes |
+ *   +--------+-----------+------------------+
+ *
+ * bit 7 of the first byte is the direction (MODEM_XFER_CAPTURE_RX or _TX),
+ * bits 0-6 hold the chunk length minus one. dt_ms is the time since the
+ * previous record, encoded as an unsigned LEB128 varint. Consecutive bytes
+ * in the same direction and the same millisecond are coalesced into one
+ * record.
+ */
+
+static const uint8_t capture_magic[8] = { 'M', 'X', 'C', 'A', 'P', 1, 0, 0 };
+
+static int capture_write(modem_xfer_capture *cap, const uint8_t *buf, unsigned int n)
+{
+    if (cap->res == MODEM_XFER_RES_OK && cap->write(cap->arg, buf, n) != (int)n) {
+        cap->res = MODEM_XFER_RES_EIO;
+    }
+
+    return cap->res;
+}
+
+int modem_xfer_capture_start(modem_xfer_capture *cap,
+                             int (*write)(void *arg, const uint8_t *buf, unsigned int n),
+                             void *arg)
+{
+    cap->write = write;
+    cap->arg = arg;
+    cap->res = MODEM_XFER_RES_OK;
+    cap->last_ms = modem_xfer_clock_ms();
+    cap->chunk_ms = cap->last_ms;
+    cap->len = 0;
+
+    return capture_write(cap, capture_magic, sizeof(capture_magic));
+}
+
+int modem_xfer_capture_flush(modem_xfer_capture *cap)
+{
+    uint8_t hdr[1 + 5];
+    uint32_t dt = cap->chunk_ms - cap->last_ms;
+    unsigned int n = 0;
+
+    if (cap->len == 0) {
+        return cap->res;
+    }
+    hdr[n++] = cap->dir | (cap->len - 1);
+    do {
+        hdr[n++] = (dt & 0x7f) | (0x7f < dt ? 0x80 : 0);
+        dt >>= 7;
+    } while (dt != 0);
+    capture_write(cap, hdr, n);
+    capture_write(cap, cap->chunk, cap->len);
+    cap->last_ms = cap->chunk_ms;
+    cap->len = 0;
+
+    return cap->res;
+}
+
+int modem_xfer_capture_bytes(modem_xfer_capture *cap, uint8_t dir, const uint8_t *buf,
+                             unsigned int n)
+{
+    uint32_t now = modem_xfer_clock_ms();
+
+    while (0 < n) {
+        if (cap->len != 0 &&
+            (cap->dir != dir || cap->chunk_ms != now || cap->len == sizeof(cap->chunk))) {
+            modem_xfer_capture_flush(cap);
+        }
+        if (cap->len == 0) {
+            cap->dir = dir;
+            cap->chunk_ms = now;
+        }
+        cap->chunk[cap->len++] = *buf++;
+        n--;
+    }
+
+    return cap->res;
+}
+
+/*
+ * Replay
+ *
+ * Replays the received direction of a capture into the engine on a virtual
+ * clock. A byte recorded at time t is delivered by modem_xfer_replay_rx() if
+ * t falls within the requested timeout; otherwise the call times out and the
+ * clock advances by the timeout, exactly as it did in the original session.
+ * Transmitted bytes are compared with the capture and counted on mismatch.
+ */
+
+// how late the engine may transmit a recorded byte before it counts as not sent
+#define REPLAY_TX_SLACK_MS 1000
+
+static int replay_next(modem_xfer_replay *rp)
+{
+    uint8_t hdr;
+    uint8_t b;
+    uint32_t dt = 0;
+    int shift = 0;
+
+    if (rp->eof || rp->read(rp->arg, &hdr, 1) != 1) {
+        rp->eof = 1;
+        return 0;
+    }
+    do {
+        if (rp->read(rp->arg, &b, 1) != 1 || 28 < shift) {
+            rp->eof = 1;
+            return 0;
+        }
+        dt |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    rp->dir = hdr & MODEM_XFER_CAPTURE_RX;
+    rp->len = (hdr & 0x7f) + 1;
+    rp->pos = 0;
+    rp->rec_ms += dt;
+    if (rp->read(rp->arg, rp->chunk, rp->len) != rp->len) {
+        rp->eof = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+int modem_xfer_replay_start(modem_xfer_replay *rp,
+                            int (*read)(void *arg, uint8_t *buf, unsigned int n), void *arg)
+{
+    uint8_t magic[sizeof(capture_magic)];
+
+    memset(rp, 0, sizeof(*rp));
+    rp->read = read;
+    rp->arg = arg;
+    if (read(arg, magic, sizeof(magic)) != sizeof(magic) ||
+        memcmp(magic, capture_magic, 6) != 0) {
+        rp->eof = 1;
+        return MODEM_XFER_RES_EPTOROCOL;
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+int modem_xfer_replay_rx(modem_xfer_replay *rp, uint8_t *c, int timeout_ms)
+{
+    for ( ; ; ) {
+        if (rp->pos == rp->len && !replay_next(rp)) {
+            break;
+        }
+        if (rp->dir == MODEM_XFER_CAPTURE_RX) {
+            break;
+        }
+        if (rp->now < rp->rec_ms + REPLAY_TX_SLACK_MS) {
+            /*
+             * The remote side only replied after we transmitted, so hold back
+             * the bytes behind this record until the engine transmits. This
+             * holds for any number of short polls, until the engine is well
+             * past the time it transmitted in the original session.
+             */
+            rp->now += timeout_ms;
+            return 0;
+        }
+        // the engine didn't transmit what was recorded; skip ahead
+        rp->num_tx_mismatches += rp->len - rp->pos;
+        rp->pos = rp->len;
+    }
+
+    if (rp->eof || rp->now + timeout_ms < rp->rec_ms) {
+        rp->now += timeout_ms;
+        return 0;
+    }
+    if (rp->now < rp->rec_ms) {
+        rp->now = rp->rec_ms;
+    }
+    *c = rp->chunk[rp->pos++];
+
+    return 1;
+}
+
+void modem_xfer_replay_tx(modem_xfer_replay *rp, uint8_t c)
+{
+    if (rp->pos == rp->len) {
+        replay_next(rp);
+    }
+    if (rp->eof || rp->pos == rp->len || rp->dir != MODEM_XFER_CAPTURE_TX) {
+        rp->num_tx_mismatches++;
+        return;
+    }
+    if (rp->now < rp->rec_ms) {
+        rp->now = rp->rec_ms;
+    }
+    if (rp->chunk[rp->pos++] != c) {
+        rp->num_tx_mismatches++;
+    }
+}
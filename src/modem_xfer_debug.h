@@ -24,6 +24,39 @@
 #ifndef __MODEM_XFER_DEBUG_H__
 #define __MODEM_XFER_DEBUG_H__
 
+#if defined(MODEM_XFER_NO_LOG)
+#define  err(args...) do { } while(0)
+#define warn(args...) do { } while(0)
+#define info(args...) do { } while(0)
+#define  dbg(args...) do { } while(0)
+#elif defined(MODEM_XFER_TRACE)
+/*
+ * Record binary events into the trace ring instead of formatting them.
+ * The format goes into the format table and the event only keeps its
+ * offset. At most MODEM_XFER_TRACE_ARGS integer or string arguments are
+ * allowed; strings are copied into the event, integers are cut to 32 bits.
+ */
+#define __MXT_NARGS(args...) __MXT_NARGS_(0, ##args, __modem_xfer_trace_too_many_args, \
+                                          4, 3, 2, 1, 0)
+#define __MXT_NARGS_(_0, _1, _2, _3, _4, _5, n, ...) n
+#define __MXT_ARGS(_, a, b, c, d, ...) (intptr_t)(a), (intptr_t)(b), (intptr_t)(c), (intptr_t)(d)
+#define __MXT_STR(a) _Generic((a) + 0, char *: 1, const char *: 1, default: 0)
+#define __MXT_STRS(_, a, b, c, d, ...) \
+    (__MXT_STR(a) | __MXT_STR(b) << 1 | __MXT_STR(c) << 2 | __MXT_STR(d) << 3)
+#define __MXT(level, fmt, args...) \
+    static const char __mxt_fmt[] __attribute__((section(MODEM_XFER_TRACE_SECTION), used)) = fmt; \
+    modem_xfer_trace_record(level, __mxt_fmt, __MXT_STRS(0, ##args, 0, 0, 0, 0), \
+                            __MXT_NARGS(args), __MXT_ARGS(0, ##args, 0, 0, 0, 0))
+
+#define  err(fmt, args...) do { __MXT(MODEM_XFER_LOG_ERROR,   fmt, ##args); } while(0)
+#define warn(fmt, args...) do { __MXT(MODEM_XFER_LOG_WARNING, fmt, ##args); } while(0)
+#define info(fmt, args...) do { __MXT(MODEM_XFER_LOG_INFO,    fmt, ##args); } while(0)
+#ifdef DEBUG
+#define  dbg(fmt, args...) do { __MXT(MODEM_XFER_LOG_DEBUG,   fmt, ##args); } while(0)
+#else
+#define  dbg(args...) do { } while(0)
+#endif
+#else  // MODEM_XFER_TRACE
 #define  err(args...) do { modem_xfer_printf(MODEM_XFER_LOG_ERROR,   args); } while(0)
 #define warn(args...) do { modem_xfer_printf(MODEM_XFER_LOG_WARNING, args); } while(0)
 #define info(args...) do { modem_xfer_printf(MODEM_XFER_LOG_INFO,    args); } while(0)
@@ -32,5 +65,6 @@
 #else
 #define  dbg(args...) do { } while(0)
 #endif
+#endif  // MODEM_XFER_TRACE
 
 #endif  // __MODEM_XFER_H__
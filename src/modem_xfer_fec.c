@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <string.h>
+
+#ifdef MODEM_XFER_FEC
+
+/*
+ * Reed-Solomon code over GF(256) for frames on noisy links
+ *
+ * The codeword is the payload of a frame followed by its CRC and nparity
+ * parity bytes, in the order they go over the wire, i.e. a shortened
+ * RS(255, 255 - nparity) code with the primitive polynomial x^8+x^4+x^3+x^2+1
+ * and the roots alpha^0 .. alpha^(nparity - 1). Up to nparity / 2 corrupted
+ * bytes anywhere in the codeword are corrected. Multiplications are lookups
+ * in the log and exp tables below, 768 bytes of ROM and no RAM.
+ */
+
+// alpha^i, twice over so that a sum of two logarithms needs no modulo
+static const uint8_t gf_exp[512] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+    0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+    0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+    0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+    0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+    0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+    0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+    0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+    0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+    0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+    0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+    0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+    0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+    0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+    0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+    0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+    0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+    0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+    0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+    0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+    0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+    0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+    0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+    0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+    0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+    0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+    0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+    0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+    0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+    0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+    0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+    0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01, 0x02,
+};
+
+// log of each non-zero element, gf_log[0] is unused
+static const uint8_t gf_log[256] = {
+    0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6, 0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
+    0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81, 0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
+    0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21, 0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
+    0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9, 0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
+    0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd, 0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
+    0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd, 0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
+    0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e, 0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
+    0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b, 0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
+    0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d, 0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
+    0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c, 0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
+    0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd, 0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
+    0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e, 0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
+    0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76, 0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
+    0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa, 0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
+    0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51, 0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
+    0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8, 0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf,
+};
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return (a == 0 || b == 0) ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_div(uint8_t a, uint8_t b)
+{
+    return a == 0 ? 0 : gf_exp[gf_log[a] + 255 - gf_log[b]];
+}
+
+// the byte at position j of the codeword
+static uint8_t *fec_at(uint8_t *payload, unsigned int n, uint8_t *crc, uint8_t *parity,
+                       unsigned int j)
+{
+    if (j < n) {
+        return &payload[j];
+    }
+    if (j < n + 2) {
+        return &crc[j - n];
+    }
+
+    return &parity[j - n - 2];
+}
+
+static void fec_feed(uint8_t *parity, const uint8_t *gen, unsigned int nparity,
+                     const uint8_t *p, unsigned int n)
+{
+    unsigned int i, j;
+    uint8_t fb;
+
+    // divide by the generator polynomial, the remainder is the parity
+    for (i = 0; i < n; i++) {
+        fb = p[i] ^ parity[0];
+        for (j = 0; j + 1 < nparity; j++) {
+            parity[j] = parity[j + 1] ^ gf_mul(fb, gen[nparity - 1 - j]);
+        }
+        parity[nparity - 1] = gf_mul(fb, gen[0]);
+    }
+}
+
+/*
+ * Parity of a payload of n bytes and its CRC. nparity must be even and at most
+ * YMODEM_FEC_MAX_PARITY.
+ */
+void modem_xfer_fec_encode(const uint8_t *payload, unsigned int n, const uint8_t crc[2],
+                           uint8_t *parity, unsigned int nparity)
+{
+    uint8_t gen[YMODEM_FEC_MAX_PARITY + 1];
+    unsigned int i, j;
+
+    // gen(x) = (x - alpha^0) (x - alpha^1) ... (x - alpha^(nparity - 1)), lowest term first
+    memset(gen, 0, sizeof(gen));
+    gen[0] = 1;
+    for (i = 0; i < nparity; i++) {
+        for (j = i + 1; 0 < j; j--) {
+            gen[j] = gen[j - 1] ^ gf_mul(gen[j], gf_exp[i]);
+        }
+        gen[0] = gf_mul(gen[0], gf_exp[i]);
+    }
+    memset(parity, 0, nparity);
+    fec_feed(parity, gen, nparity, payload, n);
+    fec_feed(parity, gen, nparity, crc, 2);
+}
+
+static void fec_syndromes(uint8_t *synd, unsigned int nparity, const uint8_t *p, unsigned int n)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < nparity; i++) {
+        for (j = 0; j < n; j++) {
+            synd[i] = gf_mul(synd[i], gf_exp[i]) ^ p[j];
+        }
+    }
+}
+
+/*
+ * Correct the payload, its CRC and the parity in place. Returns the number of
+ * corrected bytes, or -1 if there are more errors than the code can locate.
+ * The CRC should still be checked, as too many errors may look like few.
+ */
+int modem_xfer_fec_correct(uint8_t *payload, unsigned int n, uint8_t crc[2], uint8_t *parity,
+                           unsigned int nparity)
+{
+    uint8_t synd[YMODEM_FEC_MAX_PARITY];
+    uint8_t lambda[YMODEM_FEC_MAX_PARITY + 1], prev[YMODEM_FEC_MAX_PARITY + 1];
+    uint8_t tmp[YMODEM_FEC_MAX_PARITY + 1];
+    uint8_t omega[YMODEM_FEC_MAX_PARITY];
+    uint8_t d, b, x, xinv, num, den, e;
+    unsigned int len = n + 2 + nparity;
+    unsigned int i, j, k, m, p, nerr, found;
+
+    memset(synd, 0, sizeof(synd));
+    fec_syndromes(synd, nparity, payload, n);
+    fec_syndromes(synd, nparity, crc, 2);
+    fec_syndromes(synd, nparity, parity, nparity);
+    for (i = 0; i < nparity && synd[i] == 0; i++) {
+    }
+    if (i == nparity) {
+        return 0;
+    }
+
+    // Berlekamp-Massey: the shortest LFSR, lambda(x), which generates the syndromes
+    memset(lambda, 0, sizeof(lambda));
+    memset(prev, 0, sizeof(prev));
+    lambda[0] = prev[0] = 1;
+    nerr = 0;
+    m = 1;
+    b = 1;
+    for (k = 0; k < nparity; k++) {
+        d = synd[k];
+        for (i = 1; i <= nerr; i++) {
+            d ^= gf_mul(lambda[i], synd[k - i]);
+        }
+        if (d == 0) {
+            m++;
+            continue;
+        }
+        memcpy(tmp, lambda, sizeof(tmp));
+        for (i = 0; i + m <= nparity; i++) {
+            lambda[i + m] ^= gf_mul(gf_div(d, b), prev[i]);
+        }
+        if (2 * nerr <= k) {
+            nerr = k + 1 - nerr;
+            memcpy(prev, tmp, sizeof(prev));
+            b = d;
+            m = 1;
+        } else {
+            m++;
+        }
+    }
+    if (nparity / 2 < nerr) {
+        return -1;
+    }
+
+    // omega(x) = synd(x) lambda(x) mod x^nparity
+    for (i = 0; i < nparity; i++) {
+        omega[i] = 0;
+        for (j = 0; j <= i && j <= nerr; j++) {
+            omega[i] ^= gf_mul(lambda[j], synd[i - j]);
+        }
+    }
+
+    // Chien search over the positions of the shortened code, Forney for the values
+    found = 0;
+    for (p = 0; p < len && found < nerr; p++) {
+        // the byte at degree p, i.e. at position len - 1 - p, has the locator alpha^p
+        xinv = gf_exp[(255 - p) % 255];
+        num = 0;
+        x = 1;
+        for (i = 0; i <= nerr; i++) {
+            num ^= gf_mul(lambda[i], x);
+            x = gf_mul(x, xinv);
+        }
+        if (num != 0) {
+            continue;
+        }
+        num = 0;
+        x = 1;
+        for (i = 0; i < nparity; i++) {
+            num ^= gf_mul(omega[i], x);
+            x = gf_mul(x, xinv);
+        }
+        // lambda'(x) has only the odd terms of lambda(x) in characteristic 2
+        den = 0;
+        x = 1;
+        for (i = 1; i <= nerr; i += 2) {
+            den ^= gf_mul(lambda[i], x);
+            x = gf_mul(x, gf_mul(xinv, xinv));
+        }
+        if (den == 0) {
+            return -1;
+        }
+        e = gf_mul(gf_exp[p], gf_div(num, den));
+        *fec_at(payload, n, crc, parity, len - 1 - p) ^= e;
+        found++;
+    }
+    if (found != nerr) {
+        return -1;
+    }
+
+    return (int)nerr;
+}
+
+/*
+ * On the sender, the parity bytes offered for each data frame (0 to turn FEC off).
+ * On the receiver, the most it accepts. Odd counts are rounded down.
+ */
+void ymodem_set_fec(ymodem_context *ctx, uint8_t nparity)
+{
+    if (YMODEM_FEC_MAX_PARITY < nparity) {
+        nparity = YMODEM_FEC_MAX_PARITY;
+    }
+    ctx->fec_parity = nparity & ~1;
+}
+
+#endif  // MODEM_XFER_FEC
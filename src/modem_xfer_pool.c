@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <string.h>
+
+//#define DEBUG
+
+#include "modem_xfer_debug.h"
+
+#ifdef MODEM_XFER_POOL
+
+/*
+ * Frame buffer pool
+ *
+ * A server with many sessions lets them borrow a frame buffer only while a
+ * frame is in flight, so memory follows the number of active frames instead
+ * of the number of sessions. Free buffers form a lock-free stack (Treiber)
+ * whose head is a 16-bit index tagged with a 16-bit counter against ABA, so a
+ * single 32-bit compare-and-swap does on any target. The links live apart from
+ * the buffers, so reading the link of a buffer that another thread has just
+ * taken races with nothing but the failing CAS.
+ *
+ * A thread with many sessions may add a modem_xfer_pool_cache of its own. It
+ * keeps up to MODEM_XFER_POOL_CACHE buffers locally and only touches the shared
+ * stack when it runs dry or overflows.
+ */
+
+#define POOL_NIL 0xffff
+#define POOL_INDEX(head) ((head) & 0xffff)
+#define POOL_TAGGED(head, index) ((((head) + 0x10000) & 0xffff0000) | (index))
+
+int modem_xfer_pool_init(modem_xfer_pool *pool, uint8_t *mem, uint32_t mem_size,
+                         uint16_t buf_size)
+{
+    uint32_t n = mem_size / ((uint32_t)buf_size + sizeof(uint16_t));
+    uint16_t i;
+
+    // an even size keeps the links behind the buffers aligned
+    if (buf_size == 0 || (buf_size & 1) || n == 0) {
+        return MODEM_XFER_RES_ENOMEM;
+    }
+    if (POOL_NIL <= n) {
+        n = POOL_NIL - 1;
+    }
+    pool->mem = mem;
+    pool->next = (uint16_t *)&mem[n * buf_size];
+    pool->num_bufs = (uint16_t)n;
+    pool->buf_size = buf_size;
+    for (i = 0; i < n; i++) {
+        pool->next[i] = i + 1 < n ? i + 1 : POOL_NIL;
+    }
+    pool->head = 0;
+    pool->num_out = 0;
+    pool->high_water = 0;
+    pool->num_exhausted = 0;
+
+    return MODEM_XFER_RES_OK;
+}
+
+static uint16_t pool_pop(modem_xfer_pool *pool)
+{
+    uint32_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    uint32_t next, out, high;
+    uint16_t i;
+
+    do {
+        i = POOL_INDEX(head);
+        if (i == POOL_NIL) {
+            __atomic_add_fetch(&pool->num_exhausted, 1, __ATOMIC_RELAXED);
+            return POOL_NIL;
+        }
+        next = POOL_TAGGED(head, __atomic_load_n(&pool->next[i], __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, next, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    out = __atomic_add_fetch(&pool->num_out, 1, __ATOMIC_RELAXED);
+    high = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    while (high < out && !__atomic_compare_exchange_n(&pool->high_water, &high, out, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    return i;
+}
+
+static void pool_push(modem_xfer_pool *pool, uint16_t i)
+{
+    uint32_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+
+    __atomic_sub_fetch(&pool->num_out, 1, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&pool->next[i], POOL_INDEX(head), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, POOL_TAGGED(head, i), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Take a buffer of pool->buf_size bytes, NULL if there is none
+ */
+uint8_t *modem_xfer_pool_acquire(modem_xfer_pool *pool, modem_xfer_pool_cache *cache)
+{
+    uint16_t i;
+
+    if (cache != NULL && 0 < cache->num) {
+        cache->num_hits++;
+        i = cache->bufs[--cache->num];
+    } else {
+        i = pool_pop(pool);
+        if (i == POOL_NIL) {
+            return NULL;
+        }
+    }
+
+    return &pool->mem[(uint32_t)i * pool->buf_size];
+}
+
+void modem_xfer_pool_release(modem_xfer_pool *pool, modem_xfer_pool_cache *cache, uint8_t *buf)
+{
+    uint16_t i = (uint16_t)((uint32_t)(buf - pool->mem) / pool->buf_size);
+
+    if (cache == NULL) {
+        pool_push(pool, i);
+        return;
+    }
+    if (cache->num == MODEM_XFER_POOL_CACHE) {
+        // hand half of them back, so that a thread doesn't sit on idle buffers
+        while (MODEM_XFER_POOL_CACHE / 2 < cache->num) {
+            pool_push(pool, cache->bufs[--cache->num]);
+        }
+    }
+    cache->bufs[cache->num++] = i;
+}
+
+void modem_xfer_pool_cache_init(modem_xfer_pool_cache *cache, modem_xfer_pool *pool)
+{
+    cache->pool = pool;
+    cache->num_hits = 0;
+    cache->num = 0;
+}
+
+/*
+ * Return every cached buffer, e.g. before the thread exits
+ */
+void modem_xfer_pool_cache_flush(modem_xfer_pool_cache *cache)
+{
+    while (0 < cache->num) {
+        pool_push(cache->pool, cache->bufs[--cache->num]);
+    }
+}
+
+#endif  // MODEM_XFER_POOL
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <string.h>
+
+#ifdef MODEM_XFER_RING
+
+/*
+ * Receive ring between a UART interrupt and the engine
+ *
+ * One producer, typically the receive ISR, and one consumer, the thread that
+ * runs the session. Each side writes only its own index and reads the other's
+ * with acquire/release ordering, so neither needs a lock, a compare-and-swap or
+ * a critical section, which keeps the ISR short on cores without atomics. The
+ * indices run freely and wrap at 16 bits, the size being a power of 2.
+ *
+ * The consumer takes whatever has arrived with a single call and at most two
+ * memcpy()s, see modem_xfer_rx_bytes() for how a port hands that to the engine.
+ */
+
+int modem_xfer_ring_init(modem_xfer_ring *ring, uint8_t *mem, uint16_t size)
+{
+    if (size == 0 || (size & (size - 1)) || 0x8000 < size) {
+        return MODEM_XFER_RES_ENOMEM;
+    }
+    ring->mem = mem;
+    ring->num_overruns = 0;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->high_water = 0;
+
+    return MODEM_XFER_RES_OK;
+}
+
+/*
+ * Producer side. Returns the number of bytes stored; those which don't fit
+ * are dropped and counted as overruns, an ISR has nobody to wait for.
+ */
+unsigned int modem_xfer_ring_put_bytes(modem_xfer_ring *ring, const uint8_t *buf, unsigned int n)
+{
+    uint16_t head = ring->head;
+    uint16_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned int i;
+
+    if ((unsigned int)(ring->mask + 1 - used) < n) {
+        ring->num_overruns += n - (ring->mask + 1 - used);
+        n = ring->mask + 1 - used;
+    }
+    for (i = 0; i < n; i++) {
+        ring->mem[(uint16_t)(head + i) & ring->mask] = buf[i];
+    }
+    // publish the bytes only after they are in place
+    __atomic_store_n(&ring->head, (uint16_t)(head + n), __ATOMIC_RELEASE);
+    if (ring->high_water < used + n) {
+        ring->high_water = used + n;
+    }
+
+    return n;
+}
+
+int modem_xfer_ring_put(modem_xfer_ring *ring, uint8_t c)
+{
+    return (int)modem_xfer_ring_put_bytes(ring, &c, 1);
+}
+
+/*
+ * Consumer side: the number of bytes waiting
+ */
+unsigned int modem_xfer_ring_count(modem_xfer_ring *ring)
+{
+    return (uint16_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail);
+}
+
+/*
+ * Consumer side: take up to n bytes, 0 if the ring is empty
+ */
+unsigned int modem_xfer_ring_drain(modem_xfer_ring *ring, uint8_t *buf, unsigned int n)
+{
+    uint16_t tail = ring->tail;
+    unsigned int avail = (uint16_t)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail);
+    unsigned int pos = tail & ring->mask;
+    unsigned int first;
+
+    if (avail < n) {
+        n = avail;
+    }
+    first = ring->mask + 1 - pos;
+    if (n < first) {
+        first = n;
+    }
+    memcpy(buf, &ring->mem[pos], first);
+    memcpy(&buf[first], ring->mem, n - first);
+    // the producer may reuse the space only after we have copied it out
+    __atomic_store_n(&ring->tail, (uint16_t)(tail + n), __ATOMIC_RELEASE);
+
+    return n;
+}
+
+#endif  // MODEM_XFER_RING
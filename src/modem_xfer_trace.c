@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#ifdef MODEM_XFER_TRACE
+
+/*
+ * Deferred-format trace
+ *
+ * Log calls only store an event id, the log level, a timestamp and up to
+ * MODEM_XFER_TRACE_ARGS arguments into a ring buffer. The id is the offset of
+ * the format string in the format table, the MODEM_XFER_TRACE_SECTION section
+ * which the log macros put every format into. Integer arguments are kept as
+ * 32 bit values and string arguments are copied into the event, cut to fit
+ * MODEM_XFER_TRACE_STR bytes in total, so nothing refers to memory which may
+ * change before the events are rendered. When the ring is full, the oldest
+ * events are overwritten and counted as lost.
+ *
+ * Any number of contexts, threads or interrupt handlers may record at once.
+ * Each reserves its slot with an atomic add on the head and marks it written
+ * with the slot's sequence number, so the reader takes no slot which is being
+ * written and drops one which was overwritten while it copied. Reading, dumping
+ * and saving are for one context at a time.
+ *
+ * Events can be rendered on the target with modem_xfer_trace_dump(), or saved
+ * with modem_xfer_trace_save() and rendered on a host by tools/mxtrace with
+ * the format table extracted from the image:
+ *
+ *   objcopy -O binary --only-section=modem_xfer_trace_fmt image fmts.bin
+ *
+ * A saved trace is a header followed by the events, all little endian:
+ *
+ *   header: "MXT1", lost (4), MODEM_XFER_TRACE_ARGS (1), MODEM_XFER_TRACE_STR (1),
+ *           reserved (2)
+ *   event:  timestamp (4), id (2), aux (2), log_level (1), nargs (1), strs (1),
+ *           reserved (1), args (4 each), str
+ */
+
+#ifdef __APPLE__
+extern const char fmt_table[] __asm("section$start$__TEXT$__mxt_fmt");
+extern const char fmt_table_end[] __asm("section$end$__TEXT$__mxt_fmt");
+#else
+extern const char __start_modem_xfer_trace_fmt[];
+extern const char __stop_modem_xfer_trace_fmt[];
+#define fmt_table __start_modem_xfer_trace_fmt
+#define fmt_table_end __stop_modem_xfer_trace_fmt
+#endif
+
+// every image which records has at least this format, so the table always exists
+static const char lost_fmt[] __attribute__((section(MODEM_XFER_TRACE_SECTION), used)) =
+    "trace: %lu event(s) lost\n";
+static modem_xfer_trace_event ring[MODEM_XFER_TRACE_SIZE];
+static uint32_t ring_seq[MODEM_XFER_TRACE_SIZE];  // 1 + number of the event in the slot
+static uint32_t ring_head;  // next event to record, taken by any writer
+static uint32_t ring_tail;  // next event to read, kept by the reader
+static uint32_t ring_lost;
+
+static modem_xfer_trace_event *trace_alloc(int log_level, uint16_t id, uint32_t *seq)
+{
+    modem_xfer_trace_event *ev;
+    uint32_t i;
+
+    *seq = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    i = *seq % MODEM_XFER_TRACE_SIZE;
+    // whoever reads the slot from now on sees that it is not complete
+    __atomic_store_n(&ring_seq[i], 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev = &ring[i];
+    ev->timestamp = modem_xfer_clock_ms();
+    ev->id = id;
+    ev->aux = 0;
+    ev->log_level = (uint8_t)log_level;
+    ev->nargs = 0;
+    ev->strs = 0;
+    ev->reserved = 0;
+
+    return ev;
+}
+
+static void trace_commit(uint32_t seq)
+{
+    __atomic_store_n(&ring_seq[seq % MODEM_XFER_TRACE_SIZE], seq + 1, __ATOMIC_RELEASE);
+}
+
+void modem_xfer_trace_record(int log_level, const char *fmt, int strs, int nargs,
+                             intptr_t a0, intptr_t a1, intptr_t a2, intptr_t a3)
+{
+    uint32_t seq;
+    modem_xfer_trace_event *ev = trace_alloc(log_level, (uint16_t)(fmt - fmt_table), &seq);
+    intptr_t args[MODEM_XFER_TRACE_ARGS] = { a0, a1, a2, a3 };
+    unsigned int len = 0;
+    int i;
+
+    ev->nargs = (uint8_t)nargs;
+    ev->strs = (uint8_t)strs;
+    for (i = 0; i < MODEM_XFER_TRACE_ARGS; i++) {
+        const char *s = (const char *)args[i];
+
+        if (i < nargs && (strs & (1 << i))) {
+            // an argument which doesn't fit any more points to the last NUL
+            ev->args[i] = len < MODEM_XFER_TRACE_STR ? len : MODEM_XFER_TRACE_STR - 1;
+            if (s == NULL) {
+                s = "(null)";
+            }
+            while (len + 1 < MODEM_XFER_TRACE_STR && *s != '\0') {
+                ev->str[len++] = *s++;
+            }
+            if (len < MODEM_XFER_TRACE_STR) {
+                ev->str[len++] = '\0';
+            }
+        } else {
+            ev->args[i] = (uint32_t)args[i];
+        }
+    }
+    ev->str[MODEM_XFER_TRACE_STR - 1] = '\0';
+    trace_commit(seq);
+}
+
+void modem_xfer_trace_hex(int log_level, uint16_t offset, const uint8_t *buf)
+{
+    uint32_t seq;
+    modem_xfer_trace_event *ev = trace_alloc(log_level, MODEM_XFER_TRACE_HEX_ID, &seq);
+
+    ev->aux = offset;
+    memcpy(ev->args, buf, 16);
+    trace_commit(seq);
+}
+
+/*
+ * Count what writers overwrote before it was read, and skip it
+ */
+static void trace_settle(void)
+{
+    uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+
+    if (MODEM_XFER_TRACE_SIZE < head - ring_tail) {
+        __atomic_add_fetch(&ring_lost, head - ring_tail - MODEM_XFER_TRACE_SIZE,
+                           __ATOMIC_RELAXED);
+        ring_tail = head - MODEM_XFER_TRACE_SIZE;
+    }
+}
+
+int modem_xfer_trace_read(modem_xfer_trace_event *ev)
+{
+    uint32_t seq, i;
+
+    for (trace_settle(); __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) != ring_tail;
+         trace_settle()) {
+        i = ring_tail % MODEM_XFER_TRACE_SIZE;
+        seq = __atomic_load_n(&ring_seq[i], __ATOMIC_ACQUIRE);
+        if (seq == 0 || (int32_t)(seq - (ring_tail + 1)) < 0) {
+            // still being written, and what follows waits for it
+            return 0;
+        }
+        if (seq == ring_tail + 1) {
+            *ev = ring[i];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }
+        ring_tail++;
+        if (seq == ring_tail && __atomic_load_n(&ring_seq[i], __ATOMIC_RELAXED) == seq) {
+            return 1;
+        }
+        // taken by a writer which lapped the reader, before or while it was copied
+        __atomic_add_fetch(&ring_lost, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+uint32_t modem_xfer_trace_lost(void)
+{
+    trace_settle();
+
+    return __atomic_load_n(&ring_lost, __ATOMIC_RELAXED);
+}
+
+int modem_xfer_trace_render(const modem_xfer_trace_event *ev, char *buf, unsigned int size)
+{
+    return modem_xfer_trace_format(fmt_table, (uint32_t)(fmt_table_end - fmt_table), ev, buf,
+                                   size);
+}
+
+void modem_xfer_trace_dump(void)
+{
+    modem_xfer_trace_event ev;
+    char line[128];
+    uint32_t lost;
+
+    trace_settle();
+    if ((lost = __atomic_exchange_n(&ring_lost, 0, __ATOMIC_RELAXED)) != 0) {
+        modem_xfer_printf(MODEM_XFER_LOG_WARNING, lost_fmt, (unsigned long)lost);
+    }
+    while (modem_xfer_trace_read(&ev)) {
+        modem_xfer_trace_render(&ev, line, sizeof(line));
+        modem_xfer_printf(ev.log_level, "[%8lu] %s", (unsigned long)ev.timestamp, line);
+    }
+}
+
+static uint8_t *put_le(uint8_t *p, uint32_t val, int n)
+{
+    while (0 < n--) {
+        *p++ = val & 0xff;
+        val >>= 8;
+    }
+
+    return p;
+}
+
+int modem_xfer_trace_save(int (*write)(void *arg, const uint8_t *buf, unsigned int n), void *arg)
+{
+    modem_xfer_trace_event ev;
+    uint8_t buf[MODEM_XFER_TRACE_EVENT_SIZE];
+    uint8_t *p;
+    int i;
+
+    trace_settle();
+    memcpy(buf, "MXT1", 4);
+    p = put_le(&buf[4], __atomic_exchange_n(&ring_lost, 0, __ATOMIC_RELAXED), 4);
+    p = put_le(p, MODEM_XFER_TRACE_ARGS, 1);
+    p = put_le(p, MODEM_XFER_TRACE_STR, 1);
+    put_le(p, 0, 2);
+    if (write(arg, buf, MODEM_XFER_TRACE_HEADER_SIZE) != MODEM_XFER_TRACE_HEADER_SIZE) {
+        return MODEM_XFER_RES_EIO;
+    }
+    while (modem_xfer_trace_read(&ev)) {
+        p = put_le(buf, ev.timestamp, 4);
+        p = put_le(p, ev.id, 2);
+        p = put_le(p, ev.aux, 2);
+        p = put_le(p, ev.log_level, 1);
+        p = put_le(p, ev.nargs, 1);
+        p = put_le(p, ev.strs, 1);
+        p = put_le(p, 0, 1);
+        for (i = 0; i < MODEM_XFER_TRACE_ARGS; i++) {
+            if (ev.id == MODEM_XFER_TRACE_HEX_ID) {
+                // hex dump bytes are kept in memory order
+                memcpy(p, &ev.args[i], 4);
+                p += 4;
+            } else {
+                p = put_le(p, ev.args[i], 4);
+            }
+        }
+        memcpy(p, ev.str, MODEM_XFER_TRACE_STR);
+        if (write(arg, buf, sizeof(buf)) != (int)sizeof(buf)) {
+            return MODEM_XFER_RES_EIO;
+        }
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+#endif  // MODEM_XFER_TRACE
+
+#if defined(MODEM_XFER_TRACE) || defined(MODEM_XFER_TRACE_DECODER)
+
+static uint32_t get_le(const uint8_t *p, int n)
+{
+    uint32_t val = 0;
+
+    while (0 < n--) {
+        val = (val << 8) | p[n];
+    }
+
+    return val;
+}
+
+int modem_xfer_trace_decode(const uint8_t buf[MODEM_XFER_TRACE_EVENT_SIZE],
+                            modem_xfer_trace_event *ev)
+{
+    int i;
+
+    ev->timestamp = get_le(&buf[0], 4);
+    ev->id = (uint16_t)get_le(&buf[4], 2);
+    ev->aux = (uint16_t)get_le(&buf[6], 2);
+    ev->log_level = buf[8];
+    ev->nargs = buf[9];
+    ev->strs = buf[10];
+    ev->reserved = 0;
+    for (i = 0; i < MODEM_XFER_TRACE_ARGS; i++) {
+        if (ev->id == MODEM_XFER_TRACE_HEX_ID) {
+            memcpy(&ev->args[i], &buf[12 + 4 * i], 4);
+        } else {
+            ev->args[i] = get_le(&buf[12 + 4 * i], 4);
+        }
+    }
+    memcpy(ev->str, &buf[12 + 4 * MODEM_XFER_TRACE_ARGS], MODEM_XFER_TRACE_STR);
+    ev->str[MODEM_XFER_TRACE_STR - 1] = '\0';
+    if (MODEM_XFER_TRACE_ARGS < ev->nargs) {
+        return MODEM_XFER_RES_EPTOROCOL;
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+static int render_hex(const modem_xfer_trace_event *ev, char *buf, unsigned int size)
+{
+    const uint8_t *p = (const uint8_t *)ev->args;
+    unsigned int n;
+    int i;
+
+    n = snprintf(buf, size, "%04X: ", ev->aux);
+    for (i = 0; i < 16 && n < size; i++) {
+        n += snprintf(&buf[n], size - n, "%02X ", p[i]);
+    }
+    for (i = 0; i < 16 && n + 1 < size; i++) {
+        buf[n++] = isprint(p[i]) ? p[i] : '.';
+    }
+    if (n + 1 < size) {
+        buf[n++] = '\n';
+    }
+    buf[n < size ? n : size - 1] = '\0';
+
+    return n;
+}
+
+int modem_xfer_trace_format(const char *fmts, uint32_t fmts_size,
+                            const modem_xfer_trace_event *ev, char *buf, unsigned int size)
+{
+    const char *fmt;
+    unsigned int n = 0;
+    int argi = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (ev->id == MODEM_XFER_TRACE_HEX_ID) {
+        return render_hex(ev, buf, size);
+    }
+    if (fmts_size <= ev->id || memchr(&fmts[ev->id], '\0', fmts_size - ev->id) == NULL) {
+        return snprintf(buf, size, "<unknown event %u>\n", ev->id);
+    }
+
+    fmt = &fmts[ev->id];
+    while (*fmt != '\0' && n + 1 < size) {
+        char spec[16];
+        int len = 0;
+        int longs = 0;
+        int is_str;
+        uint32_t arg;
+
+        if (*fmt != '%') {
+            buf[n++] = *fmt++;
+            continue;
+        }
+        if (fmt[1] == '%') {
+            buf[n++] = '%';
+            fmt += 2;
+            continue;
+        }
+
+        // collect flags, width, precision and length modifiers
+        spec[len++] = *fmt++;
+        while (*fmt != '\0' && strchr("-+ #0123456789.hlzjt", *fmt) != NULL &&
+               len < (int)sizeof(spec) - 2) {
+            if (*fmt == 'l') {
+                longs++;
+            }
+            spec[len++] = *fmt++;
+        }
+        if (*fmt == '\0') {
+            break;
+        }
+        spec[len++] = *fmt;
+        spec[len] = '\0';
+        arg = argi < ev->nargs ? ev->args[argi] : 0;
+        is_str = argi < ev->nargs && (ev->strs & (1 << argi));
+        argi++;
+
+        switch (*fmt++) {
+        case 'd':
+        case 'i':
+        case 'c':
+            if (longs == 0) {
+                n += snprintf(&buf[n], size - n, spec, (int)(int32_t)arg);
+            } else
+            if (longs == 1) {
+                n += snprintf(&buf[n], size - n, spec, (long)(int32_t)arg);
+            } else {
+                n += snprintf(&buf[n], size - n, spec, (long long)(int32_t)arg);
+            }
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            if (longs == 0) {
+                n += snprintf(&buf[n], size - n, spec, (unsigned int)arg);
+            } else
+            if (longs == 1) {
+                n += snprintf(&buf[n], size - n, spec, (unsigned long)arg);
+            } else {
+                n += snprintf(&buf[n], size - n, spec, (unsigned long long)arg);
+            }
+            break;
+        case 's':
+            n += snprintf(&buf[n], size - n, spec,
+                          is_str && arg < MODEM_XFER_TRACE_STR ? &ev->str[arg] : "(?)");
+            break;
+        case 'p':
+            n += snprintf(&buf[n], size - n, "0x%08lx", (unsigned long)arg);
+            break;
+        default:
+            n += snprintf(&buf[n], size - n, "%s", spec);
+            break;
+        }
+    }
+    if (size <= n) {
+        n = size - 1;
+    }
+    buf[n] = '\0';
+
+    return n;
+}
+
+#endif  // MODEM_XFER_TRACE || MODEM_XFER_TRACE_DECODER
@@ -22,7 +22,6 @@
  */
 
 #include <modem_xfer.h>
-#include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
@@ -45,42 +44,309 @@
 #include "modem_xfer_debug.h"
 #include "ymodem.h"
 
-int ymodem_receive(uint8_t buf[MODEM_XFER_BUF_SIZE])
+#ifndef MODEM_XFER_NO_RECEIVE
+/*
+ * Receive files into a context from ymodem_receive_init(), so that the caller
+ * can set its baud, poll_ms, pool or sync policy first
+ */
+int ymodem_receive_ctx(ymodem_context *ctx)
 {
     int res;
     unsigned int n;
+    int empty = 1;
 
-    ymodem_context ctx;
-    ymodem_receive_init(&ctx, buf);
-    while ((res = ymodem_receive_block(&ctx, &n)) == MODEM_XFER_RES_OK) {
-        if (ctx.file_name[0] == '\0') {
+    ctx->flags |= YMODEM_FLAG_EOF_BLOCK;
+    #ifdef MODEM_XFER_DELTA
+    ctx->flags |= YMODEM_FLAG_DELTA;
+    #endif
+    #ifdef MODEM_XFER_PACK
+    ctx->flags |= YMODEM_FLAG_PACK;
+    #endif
+    while ((res = ymodem_receive_block(ctx, &n)) == MODEM_XFER_RES_OK) {
+        if (ctx->file_name[0] == '\0') {
             return MODEM_XFER_RES_OK;
         }
-        res = modem_xfer_save(ctx.file_name, ctx.file_offset, ctx.buf, n);
+        if (n == 0) {
+            // end of file
+            if (empty && !(ctx->flags & (YMODEM_FLAG_PACK_ACTIVE | YMODEM_FLAG_DELTA_ACTIVE))) {
+                // no block was saved, but the file must exist and be empty
+                res = modem_xfer_save(ctx->file_name, 0, NULL, 0);
+                if (res != MODEM_XFER_RES_OK) {
+                    ymodem_send_cancel(ctx);
+                    break;
+                }
+            }
+            empty = 1;
+            #ifdef MODEM_XFER_DELTA
+            if ((ctx->flags & YMODEM_FLAG_DELTA_ACTIVE) && ctx->file_size != 0) {
+                // the old copy might be longer than the new one
+                res = modem_xfer_save(ctx->file_name, ctx->file_size, NULL, 0);
+                if (res != MODEM_XFER_RES_OK) {
+                    ymodem_send_cancel(ctx);
+                    break;
+                }
+            }
+            #endif
+            #ifdef MODEM_XFER_PACK
+            if ((ctx->flags & YMODEM_FLAG_PACK_ACTIVE) && (res = ymodem_unpack_end(ctx)) != 0) {
+                ymodem_send_cancel(ctx);
+                break;
+            }
+            #endif
+            if (ctx->digest_stat == YMODEM_DIGEST_MISMATCH) {
+                // not what the sender had, and the caller can't see digest_stat
+                res = MODEM_XFER_RES_EIO;
+                ymodem_send_cancel(ctx);
+                break;
+            }
+            #ifdef MODEM_XFER_DURABLE
+            res = ymodem_commit(ctx, 0);
+            if (res != MODEM_XFER_RES_OK) {
+                ymodem_send_cancel(ctx);
+                break;
+            }
+            #endif
+            continue;
+        }
+        #ifdef MODEM_XFER_PACK
+        if (ctx->flags & YMODEM_FLAG_PACK_ACTIVE) {
+            res = ymodem_unpack(ctx, ctx->buf, n);
+        } else
+        #endif
+        res = modem_xfer_save(ctx->file_name, ctx->file_offset, ctx->buf, n);
+        empty = 0;
+        #ifdef MODEM_XFER_DURABLE
+        if (res == MODEM_XFER_RES_OK) {
+            res = ymodem_commit(ctx, n);
+        }
+        #endif
         if (res != MODEM_XFER_RES_OK) {
-            ymodem_send_cancel(&ctx);
-            return res;
+            ymodem_send_cancel(ctx);
+            break;
         }
     }
+    #ifdef MODEM_XFER_DURABLE
+    // the old copy of an incomplete file stays as it was
+    ymodem_commit_abort(ctx);
+    #endif
 
     return res;
 }
 
+int ymodem_receive(uint8_t buf[MODEM_XFER_BUF_SIZE])
+{
+    ymodem_context ctx;
+
+    ymodem_receive_init(&ctx, buf);
+    return ymodem_receive_ctx(&ctx);
+}
+
 void ymodem_receive_init(ymodem_context *ctx, uint8_t buf[MODEM_XFER_BUF_SIZE])
 {
     dbg("--: %s:\n",  __func__);
     ctx->stat = MODEM_XFER_STAT_INIT;
     ctx->buf = buf;
     ctx->num_files_xfered = 0;
+    ctx->num_dup_frames = 0;
     ctx->seqno = 0;
+    ctx->flags = 0;
+    ctx->baud = MODEM_XFER_BAUD;
+    ctx->cancel_req = 0;
+    ctx->poll_ms = MODEM_XFER_REQ_POLL_MS;
+    ctx->caps = YMODEM_CAPS_DEFAULT;
+    ctx->peer_caps = 0;
+    ctx->digest_stat = YMODEM_DIGEST_NONE;
+    #ifdef MODEM_XFER_FEC
+    ctx->fec_parity = YMODEM_FEC_PARITY;
+    ctx->fec_active = 0;
+    ctx->fec_corrected = 0;
+    ctx->fec_failed = 0;
+    #endif
+    #ifdef MODEM_XFER_POOL
+    ctx->pool = NULL;
+    ctx->pool_cache = NULL;
+    #endif
+    #ifdef MODEM_XFER_DURABLE
+    ctx->sync_policy = YMODEM_SYNC_FILE;
+    ctx->sync_bytes = 0;
+    ctx->sync_ms = 0;
+    ctx->sync_stat = 0;
+    #endif
+}
+
+static void ymodem_parse_ext(ymodem_context *ctx, const char *ext)
+{
+    uint32_t caps;
+    #ifdef MODEM_XFER_FEC
+    uint32_t nparity;
+    #endif
+
+    /*
+     * Extensions follow the NUL of the file info string, so classic receivers
+     * ignore them. Tokens are separated by spaces.
+     */
+    while (*ext != '\0') {
+        if (strncmp(ext, "caps=", 5) == 0 && modem_xfer_xtou(&ext[5], &caps) != 0) {
+            ctx->flags |= YMODEM_FLAG_CAPS;
+            ctx->peer_caps = (uint8_t)caps & ctx->caps & 0x7f;
+            if (!(ctx->flags & YMODEM_FLAG_PACK)) {
+                ctx->peer_caps &= ~YMODEM_CAP_PACK;
+            }
+        }
+        #ifndef MODEM_XFER_NO_DIGEST
+        if (strncmp(ext, "crc32=", 6) == 0 && modem_xfer_xtou(&ext[6], &ctx->peer_crc32) != 0) {
+            ctx->flags |= YMODEM_FLAG_PEER_CRC32;
+        }
+        #endif
+        if (strncmp(ext, "delta", 5) == 0 && (ext[5] == '\0' || ext[5] == ' ') &&
+            (ctx->flags & YMODEM_FLAG_DELTA)) {
+            ctx->flags |= YMODEM_FLAG_DELTA_ACTIVE;
+        }
+        if (strncmp(ext, "pack", 4) == 0 && (ext[4] == '\0' || ext[4] == ' ') &&
+            (ctx->flags & YMODEM_FLAG_PACK)) {
+            ctx->flags |= YMODEM_FLAG_PACK_ACTIVE;
+        }
+        #ifdef MODEM_XFER_FEC
+        // a parity count we can't take is declined by not sending FREQ
+        if (strncmp(ext, "fec=", 4) == 0 && modem_xfer_atou(&ext[4], &nparity) != 0 &&
+            nparity != 0 && nparity <= ctx->fec_parity && (nparity & 1) == 0) {
+            ctx->fec_active = (uint8_t)nparity;
+        }
+        #endif
+        while (*ext != '\0' && *ext != ' ') {
+            ext++;
+        }
+        while (*ext == ' ') {
+            ext++;
+        }
+    }
+}
+
+/*
+ * Interval of the start byte while waiting for a header, so that a receiver
+ * sends at least one within MODEM_XFER_REQ_WAIT_MS however poll_ms was set
+ */
+static uint32_t ymodem_poll_ms(ymodem_context *ctx)
+{
+    if (ctx->poll_ms == 0) {
+        return MODEM_XFER_REQ_POLL_MS;
+    }
+
+    return ctx->poll_ms < MODEM_XFER_REQ_WAIT_MS ? ctx->poll_ms : MODEM_XFER_REQ_WAIT_MS;
+}
+
+/*
+ * 'C', or the agreed capabilities if the sender advertised its own
+ */
+static uint8_t ymodem_start_byte(ymodem_context *ctx)
+{
+    return (ctx->flags & YMODEM_FLAG_CAPS) ? 0x80 | ctx->peer_caps : REQ;
+}
+
+static void ymodem_send_start(ymodem_context *ctx)
+{
+    #ifdef MODEM_XFER_FEC
+    if (ctx->fec_active) {
+        // frames are self-describing, so a lost FREQ only costs the correction
+        modem_xfer_tx(FREQ);
+    }
+    #endif
+    dbg("%02X: send REQ %02X\n", ctx->seqno, ymodem_start_byte(ctx));
+    modem_xfer_tx(ymodem_start_byte(ctx));
+}
+
+#ifdef MODEM_XFER_FEC
+/*
+ * Repair the payload and CRC of an FSOH frame from its parity bytes. The CRC
+ * must match afterwards, as an overwhelmed decoder can miscorrect.
+ */
+static int ymodem_fec_repair(ymodem_context *ctx, uint8_t *buf, uint8_t crc_buf[2],
+                             uint8_t *parity)
+{
+    int k = modem_xfer_fec_correct(buf, BUFSIZE, crc_buf, parity, ctx->fec_active);
+
+    if (k < 0 || (crc_buf[0] * 256 + crc_buf[1]) != modem_xfer_crc16(0, buf, BUFSIZE)) {
+        ctx->fec_failed++;
+        dbg("%02X: FEC failed\n", ctx->seqno);
+        return MODEM_XFER_RES_CANCELED;
+    }
+    ctx->fec_corrected += k;
+    dbg("%02X: FEC corrected %d bytes\n", ctx->seqno, k);
+
+    return MODEM_XFER_RES_OK;
+}
+#define ymodem_fec_frame(ctx, c) \
+    ((c) == FSOH && (ctx)->stat == MODEM_XFER_STAT_XFER && (ctx)->fec_active)
+#else
+#define ymodem_fec_repair(ctx, buf, crc_buf, parity) MODEM_XFER_RES_CANCELED
+#define ymodem_fec_frame(ctx, c) 0
+#endif  // MODEM_XFER_FEC
+
+static void ymodem_check_digest(ymodem_context *ctx)
+{
+    #ifdef MODEM_XFER_NO_DIGEST
+    ctx->digest_stat = YMODEM_DIGEST_NONE;
+    #else
+    if (!(ctx->flags & YMODEM_FLAG_PEER_CRC32)) {
+        ctx->digest_stat = YMODEM_DIGEST_NONE;
+        return;
+    }
+    if (ctx->file_crc32 == ctx->peer_crc32) {
+        ctx->digest_stat = YMODEM_DIGEST_OK;
+        dbg("%02X: crc32 %08lx OK\n", ctx->seqno, (unsigned long)ctx->file_crc32);
+    } else {
+        ctx->digest_stat = YMODEM_DIGEST_MISMATCH;
+        err("'%s': crc32 %08lx != %08lx\n", ctx->file_name, (unsigned long)ctx->file_crc32,
+            (unsigned long)ctx->peer_crc32);
+    }
+    #endif
+}
+
+#ifdef MODEM_XFER_POOL
+/*
+ * With a pool, the session holds a buffer only from the start of a frame until
+ * the caller is done with its payload, i.e. the next ymodem_receive_block().
+ */
+void ymodem_receive_pool(ymodem_context *ctx, modem_xfer_pool *pool,
+                         modem_xfer_pool_cache *cache)
+{
+    ctx->pool = pool;
+    ctx->pool_cache = cache;
+    ctx->buf = NULL;
+}
+
+static uint8_t *ymodem_borrow_buf(ymodem_context *ctx)
+{
+    if (ctx->pool != NULL && ctx->buf == NULL) {
+        ctx->buf = modem_xfer_pool_acquire(ctx->pool, ctx->pool_cache);
+    }
+
+    return ctx->buf;
 }
 
+static void ymodem_return_buf(ymodem_context *ctx)
+{
+    if (ctx->pool != NULL && ctx->buf != NULL) {
+        modem_xfer_pool_release(ctx->pool, ctx->pool_cache, ctx->buf);
+        ctx->buf = NULL;
+    }
+}
+#else
+#define ymodem_borrow_buf(ctx) ((ctx)->buf)
+#define ymodem_return_buf(ctx) do { } while (0)
+#endif  // MODEM_XFER_POOL
+
 int ymodem_receive_block(ymodem_context *ctx, unsigned int *sizep)
 {
-    int res, retry;
-    uint8_t *buf = ctx->buf;
+    int res, retry, dup;
+    uint8_t *buf;
+    uint8_t hdr[3];  // SOH seqno ~seqno, or a single control byte
     uint16_t crc;
     uint8_t crc_buf[2];
+    uint32_t seqno_deadline, body_deadline, frame_deadline;
+    #ifdef MODEM_XFER_FEC
+    uint8_t parity[YMODEM_FEC_MAX_PARITY];
+    #endif
 
     if (ctx->stat == MODEM_XFER_STAT_END) {
         *sizep = 0;
@@ -91,8 +357,16 @@ int ymodem_receive_block(ymodem_context *ctx, unsigned int *sizep)
     }
 
  entry:
+    // nothing of the last frame is needed any more
+    ymodem_return_buf(ctx);
     retry = 0;
-    while (retry++ < (ctx->stat == MODEM_XFER_STAT_INIT ? 25 : 5)) {
+    // keep polling for about MODEM_XFER_REQ_WAIT_MS, however short the interval is
+    while (retry++ < (ctx->stat == MODEM_XFER_STAT_INIT ?
+                      MODEM_XFER_REQ_WAIT_MS / ymodem_poll_ms(ctx) : 5)) {
+        if (__ymodem_canceled(ctx)) {
+            ymodem_return_buf(ctx);
+            return MODEM_XFER_RES_CANCELED;
+        }
         if (ctx->stat == MODEM_XFER_STAT_INIT) {
             dbg("%02X: send REQ\n", ctx->seqno);
             modem_xfer_tx(REQ);
@@ -101,47 +375,110 @@ int ymodem_receive_block(ymodem_context *ctx, unsigned int *sizep)
         /*
          * receive block herader
          */
-        if (modem_xfer_recv_bytes(buf, 1, 1000) != 1) {
+        if (YMODEM_RECV(ctx, hdr, 1, modem_xfer_clock_ms() +
+                        (ctx->stat == MODEM_XFER_STAT_INIT ? ymodem_poll_ms(ctx) : 1000)) != 1) {
             dbg("%02X: header timeout\n", ctx->seqno);
             continue;
         }
 
-        if (ctx->stat == MODEM_XFER_STAT_XFER && buf[0] == EOT) {
+        if (ctx->stat == MODEM_XFER_STAT_XFER && hdr[0] == EOT) {
             dbg("%02X: EOT\n", ctx->seqno);
             modem_xfer_tx(NAK);
-            modem_xfer_recv_bytes(&buf[0], 1, 1000);
-            if (buf[0] != EOT) {
-                warn("WARNING: EOT expected but received %02X\n", buf[0]);
+            if (YMODEM_RECV(ctx, &hdr[0], 1, YMODEM_DEADLINE(ctx, 1, 1000)) != 1 || hdr[0] != EOT) {
+                // a damaged frame header, or the sender would repeat EOT after our NAK
+                warn("WARNING: EOT expected but received %02X\n", hdr[0]);
+                goto retry;
             }
             modem_xfer_tx(ACK);
             ctx->num_files_xfered++;
             ctx->stat = MODEM_XFER_STAT_INIT;
             ctx->seqno = 0;
+            ymodem_check_digest(ctx);
+            // a repeated frame may have borrowed one, and the caller may stop here
+            ymodem_return_buf(ctx);
+            if (ctx->flags & YMODEM_FLAG_EOF_BLOCK) {
+                *sizep = 0;
+                return MODEM_XFER_RES_OK;
+            }
             goto entry;
         }
-        if (buf[0] != SOH) {
-            dbg("%02X: invalid header %02X\n", ctx->seqno, buf[0]);
+        if (ctx->stat == MODEM_XFER_STAT_INIT && hdr[0] == EOT && 0 < ctx->num_files_xfered) {
+            // the ACK of the last EOT was lost and the sender repeats it
+            dbg("%02X: duplicate EOT\n", ctx->seqno);
+            modem_xfer_tx(ACK);
+            ctx->num_dup_frames++;
+            retry = 0;
+            continue;
+        }
+        #ifdef MODEM_XFER_DELTA
+        if (ctx->stat == MODEM_XFER_STAT_XFER && hdr[0] == SKP &&
+            (ctx->flags & YMODEM_FLAG_DELTA_ACTIVE)) {
+            res = __ymodem_delta_recv_skip(ctx);
+            if (res == MODEM_XFER_RES_EIO) {
+                // acknowledged, but not in the new copy
+                break;
+            }
+            if (res != MODEM_XFER_RES_OK) {
+                goto retry;
+            }
+            goto entry;
+        }
+        #endif
+        if (hdr[0] == CAN) {
+            // CAN CAN from the sender aborts the transfer at once
+            if (YMODEM_RECV(ctx, &hdr[1], 1, YMODEM_DEADLINE(ctx, 1, 300)) == 1 && hdr[1] == CAN) {
+                info("%02X: canceled by the sender\n", ctx->seqno);
+                ymodem_return_buf(ctx);
+                return MODEM_XFER_RES_CANCELED;
+            }
+            goto retry;
+        }
+        if (hdr[0] != SOH && !ymodem_fec_frame(ctx, hdr[0])) {
+            dbg("%02X: invalid header %02X\n", ctx->seqno, hdr[0]);
             goto retry;
         }
 
+        /*
+         * Each phase of the frame has its own deadline and the whole frame must
+         * arrive by frame_deadline, however slowly the bytes trickle in.
+         */
+        seqno_deadline = YMODEM_DEADLINE(ctx, 2, 300);
+        body_deadline = YMODEM_DEADLINE(ctx, 2 + BUFSIZE, 1000);
+        frame_deadline = body_deadline + modem_xfer_frame_ms(ctx->baud, 2);
+        #ifdef MODEM_XFER_FEC
+        if (hdr[0] == FSOH) {
+            frame_deadline += modem_xfer_frame_ms(ctx->baud, ctx->fec_active);
+        }
+        #endif
+
         /*
          * receive sequence number
          */
-        if (modem_xfer_recv_bytes(&buf[1], 2, 300) != 2) {
+        if (YMODEM_RECV(ctx, &hdr[1], 2, seqno_deadline) != 2) {
             dbg("%02X: seqno timeout\n", ctx->seqno);
             goto retry;
         }
-        dbg("%02X: %02X %02X %02X\n", ctx->seqno, buf[0], buf[1], buf[1]);
-        //if (buf[1] != ctx->seqno && buf[2] != ((~ctx->seqno) + 1)) {
-        if (buf[1] != ctx->seqno && buf[2] != ((~ctx->seqno))) {
+        dbg("%02X: %02X %02X %02X\n", ctx->seqno, hdr[0], hdr[1], hdr[2]);
+        if (hdr[2] != (uint8_t)~hdr[1]) {
+            dbg("%02X: broken sequence number\n", ctx->seqno);
+            goto retry;
+        }
+        // the previous frame again means that our ACK was lost
+        dup = ctx->stat == MODEM_XFER_STAT_XFER && hdr[1] == (uint8_t)(ctx->seqno - 1);
+        if (hdr[1] != ctx->seqno && !dup) {
             dbg("%02X: invalid sequence number\n", ctx->seqno);
             goto retry;
         }
+        if ((buf = ymodem_borrow_buf(ctx)) == NULL) {
+            // the sender repeats the frame after our NAK
+            warn("%02X: no frame buffer\n", ctx->seqno);
+            goto retry;
+        }
 
         /*
          * receive payload
          */
-        int n = modem_xfer_recv_bytes(buf, BUFSIZE, 1000);
+        int n = YMODEM_RECV(ctx, buf, BUFSIZE, body_deadline);
         if (n != BUFSIZE) {
             info("%02X: payload timeout, n=%d\n", ctx->seqno, n);
             goto retry;
@@ -151,40 +488,118 @@ int ymodem_receive_block(ymodem_context *ctx, unsigned int *sizep)
         modem_xfer_hex_dump(MODEM_XFER_LOG_DEBUG, buf, BUFSIZE);
         #endif
         crc = modem_xfer_crc16(0, buf, BUFSIZE);
-        if (modem_xfer_recv_bytes(crc_buf, 2, 1000) != 2) {
+        if (YMODEM_RECV(ctx, crc_buf, 2, frame_deadline) != 2) {
             err("%02X: CEC timeout\n", ctx->seqno);
             goto retry;
         }
+        #ifdef MODEM_XFER_FEC
+        if (hdr[0] == FSOH &&
+            YMODEM_RECV(ctx, parity, ctx->fec_active, frame_deadline) != ctx->fec_active) {
+            err("%02X: parity timeout\n", ctx->seqno);
+            goto retry;
+        }
+        #endif
         dbg("%02X: crc16: %04x %s %04x\n", ctx->seqno, crc_buf[0] * 256 + crc_buf[1],
             (crc_buf[0] * 256 + crc_buf[1]) == crc ? "==" : "!=", crc);
         if ((crc_buf[0] * 256 + crc_buf[1]) != crc) {
-            goto retry;
+            // an intact frame never pays for decoding, a damaged one is NAKed only if beyond repair
+            if (hdr[0] != FSOH || ymodem_fec_repair(ctx, buf, crc_buf, parity) != MODEM_XFER_RES_OK) {
+                goto retry;
+            }
         }
         modem_xfer_tx(ACK);
 
+        if (dup) {
+            // the caller already has this block, so just acknowledge it again
+            ctx->num_dup_frames++;
+            // the sender waits longer for an ACK than we wait for a frame, so a lost
+            // ACK costs most of our retries, but the link evidently works
+            retry = 0;
+            dbg("%02X: duplicate frame %02X\n", ctx->seqno, (uint8_t)(ctx->seqno - 1));
+            if (ctx->seqno == 1 && ctx->file_offset == 0) {
+                // the file header, which is followed by a start byte
+                ymodem_send_start(ctx);
+            }
+            continue;
+        }
         if (ctx->stat == MODEM_XFER_STAT_INIT) {
             memcpy(ctx->file_name, buf, sizeof(ctx->file_name));
             ctx->file_name[sizeof(ctx->file_name) - 1] = '\0';
             if (ctx->file_name[0] == 0x00) {
                 info("total %d file%s received\n", ctx->num_files_xfered,
                      1 < ctx->num_files_xfered ? "s" : "");
+                if (ctx->num_dup_frames != 0) {
+                    info("%lu duplicate frame%s acknowledged again\n",
+                         (unsigned long)ctx->num_dup_frames, 1 < ctx->num_dup_frames ? "s" : "");
+                }
+                #ifdef MODEM_XFER_FEC
+                if (ctx->fec_corrected != 0 || ctx->fec_failed != 0) {
+                    info("FEC: %lu bytes corrected, %lu frames beyond repair\n",
+                         (unsigned long)ctx->fec_corrected, (unsigned long)ctx->fec_failed);
+                }
+                #endif
                 modem_xfer_tx(ACK);
                 ctx->stat = MODEM_XFER_STAT_END;
+                ymodem_return_buf(ctx);
                 return MODEM_XFER_RES_OK;
             }
+            if (!modem_xfer_name_ok(ctx->file_name)) {
+                // before the name reaches a port, which might even load an old copy of it
+                err("refuse file name '%s'\n", ctx->file_name);
+                break;
+            }
             buf[BUFSIZE - 1] = '\0';  // fail safe
             modem_xfer_hex_dump(MODEM_XFER_LOG_DEBUG, buf, 16);
-            dbg("file info string: %s\n", &buf[strlen((char *)buf) + 1]);
-            if (sscanf((char*)&buf[strlen((char *)buf) + 1], "%lu", &ctx->file_size) != 1) {
+            char *file_info = (char *)&buf[strlen((char *)buf) + 1];
+            dbg("file info string: %s\n", file_info);
+            if (modem_xfer_atou(file_info, &ctx->file_size) == 0) {
                 warn("WARNING: unknown file size\n");
                 ctx->file_size = 0;
             }
+            ctx->flags &= ~(YMODEM_FLAG_PEER_CRC32 | YMODEM_FLAG_DELTA_ACTIVE |
+                            YMODEM_FLAG_PACK_ACTIVE | YMODEM_FLAG_CAPS);
+            ctx->peer_caps = 0;
+            #ifdef MODEM_XFER_FEC
+            ctx->fec_active = 0;
+            #endif
+            if (file_info + strlen(file_info) + 1 < (char *)&buf[BUFSIZE]) {
+                ymodem_parse_ext(ctx, file_info + strlen(file_info) + 1);
+            }
+            if (ctx->file_size == 0) {
+                // the old copy could never be cut to the right length
+                ctx->flags &= ~YMODEM_FLAG_DELTA_ACTIVE;
+            }
+            #ifndef MODEM_XFER_SHA256
+            if (!(ctx->flags & YMODEM_FLAG_PEER_CRC32)) {
+                // a chunk could match its CRC-32 signature and yet differ, and
+                // without the crc32 of the file nothing would tell
+                ctx->flags &= ~YMODEM_FLAG_DELTA_ACTIVE;
+            }
+            #endif
+            modem_xfer_digest_reset(ctx);
+            #ifdef MODEM_XFER_PACK
+            __ymodem_unpack_init(ctx);
+            #endif
             ctx->seqno++;
             ctx->file_offset = 0;
             ctx->stat = MODEM_XFER_STAT_XFER;
-            dbg("%02X: send REQ\n", ctx->seqno);
-            modem_xfer_tx(REQ);
-            info("receiving file '%s', %lu bytes\n", ctx->file_name, ctx->file_size);
+            #ifdef MODEM_XFER_DELTA
+            if ((ctx->flags & YMODEM_FLAG_DELTA_ACTIVE) &&
+                __ymodem_delta_send_sigs(ctx) != MODEM_XFER_RES_OK) {
+                break;
+            }
+            #endif
+            #ifdef MODEM_XFER_DURABLE
+            if (__ymodem_commit_begin(ctx) != MODEM_XFER_RES_OK) {
+                break;
+            }
+            #endif
+            if (ctx->peer_caps & YMODEM_CAP_FAST_POLL) {
+                ctx->poll_ms = MODEM_XFER_FAST_POLL_MS;
+            }
+            ymodem_send_start(ctx);
+            info("receiving file '%s', %lu bytes\n", ctx->file_name,
+                 (unsigned long)ctx->file_size);
             goto entry;
         } else {
             if (ctx->file_size == 0 || ctx->file_offset < ctx->file_size) {
@@ -193,6 +608,7 @@ int ymodem_receive_block(ymodem_context *ctx, unsigned int *sizep)
                 } else {
                     *sizep = BUFSIZE;
                 }
+                modem_xfer_digest_update(ctx, buf, *sizep);
                 ctx->seqno++;
                 return MODEM_XFER_RES_OK;
             }
@@ -200,12 +616,14 @@ int ymodem_receive_block(ymodem_context *ctx, unsigned int *sizep)
         ctx->seqno++;
         continue;
     retry:
-        res = modem_xfer_discard();
+        res = modem_xfer_discard_poll(&ctx->cancel_req);
         dbg("%02X: discard %d bytes and send NAK\n", ctx->seqno, res);
         modem_xfer_tx(NAK);
     }
 
+    ymodem_return_buf(ctx);
     ymodem_send_cancel(ctx);
 
     return MODEM_XFER_RES_CANCELED;
 }
+#endif  // MODEM_XFER_NO_RECEIVE
@@ -31,9 +31,66 @@
 #define ACK  0x06
 #define NAK  0x15
 #define CAN  0x18
+#define DREQ 'D'   // delta mode: block signatures follow
+#define SKP  0x1d  // delta mode: skip unchanged blocks
+#define FSOH 0x1e  // FEC mode: an SOH frame followed by Reed-Solomon parity
+#define FREQ 'F'   // FEC mode: the receiver takes the parity offered in the header
 
 #define BUFSIZE 128
 #define SOH_SIZE 128
 #define STX_SIZE 1024
 
+// kinds of delta signatures, in the second byte of each signature frame
+#define DELTA_SIG_CRC32  0  // weak sum and CRC-32, only with the crc32 of the whole file
+#define DELTA_SIG_SHA256 1  // weak sum and the first 16 bytes of the SHA-256
+#define DELTA_SIG_CRC32_SIZE 8
+#define DELTA_SIG_SHA256_SIZE 20
+
+// everything this build can do
+#ifdef MODEM_XFER_PACK
+#define YMODEM_CAPS_DEFAULT (YMODEM_CAP_FAST_POLL | YMODEM_CAP_PACK)
+#else
+#define YMODEM_CAPS_DEFAULT YMODEM_CAP_FAST_POLL
+#endif
+
+/*
+ * Absolute deadline for receiving n bytes: the time they take on the wire
+ * at ctx->baud plus slack_ms for the peer to react
+ */
+#define YMODEM_DEADLINE(ctx, n, slack_ms) \
+    (modem_xfer_clock_ms() + (slack_ms) + modem_xfer_frame_ms((ctx)->baud, (n)))
+
+#ifdef MODEM_XFER_FEC
+#define YMODEM_DATA_FRAME(ctx) ((ctx)->fec_active ? FSOH : SOH)
+// the receiver took our offer, which went out with the caps of our own header
+#define YMODEM_IS_FREQ(ctx, c) \
+    ((c) == FREQ && (ctx)->fec_parity != 0 && ((ctx)->flags & YMODEM_FLAG_CAPS))
+#else
+#define YMODEM_DATA_FRAME(ctx) SOH
+#endif
+
+// all waits of the engine end early on ymodem_request_cancel()
+#define YMODEM_RECV(ctx, buf, n, deadline) \
+    modem_xfer_recv_bytes_poll((buf), (n), (deadline), &(ctx)->cancel_req)
+
+// __ymodem_send_frame() of a header which the receiver answered with c after a lost ACK
+#define YMODEM_RES_ANSWERED(c) (-(int)(c))
+
+extern int __ymodem_canceled(ymodem_context *ctx);
+extern int __ymodem_is_start(ymodem_context *ctx, uint8_t c);
+extern int __ymodem_is_req(ymodem_context *ctx, uint8_t c);
+extern int __ymodem_recv_answer(ymodem_context *ctx, uint8_t *c, int header);
+extern int __ymodem_send_frame(ymodem_context *ctx, uint8_t type, const uint8_t *payload,
+                               unsigned int len, uint16_t crc);
+extern int __ymodem_delta_send_sigs(ymodem_context *ctx);
+extern int __ymodem_delta_recv_sigs(ymodem_context *ctx);
+extern int __ymodem_delta_recv_skip(ymodem_context *ctx);
+extern int __ymodem_delta_flush_skip(ymodem_context *ctx);
+extern int __ymodem_send_header_ext(ymodem_context *ctx, char *file_name, uint32_t size,
+                                    const char *ext);
+extern void __ymodem_unpack_init(ymodem_context *ctx);
+extern char *__ymodem_unpack_name(ymodem_context *ctx);
+extern int __ymodem_commit_begin(ymodem_context *ctx);
+extern int __ymodem_commit_member(ymodem_context *ctx, char *name, int end);
+
 #endif  // __MODEM_XFER_YMODEM_H__
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <string.h>
+
+//#define DEBUG
+
+#include "modem_xfer_debug.h"
+#include "ymodem.h"
+
+#if defined(MODEM_XFER_DURABLE) && !defined(MODEM_XFER_NO_RECEIVE)
+
+/*
+ * Durability of received files
+ *
+ * Each file is saved into a new copy which replaces the old one only once it
+ * is complete, so a power loss leaves either the old or the new file. The port
+ * does the actual work in modem_xfer_commit(): BEGIN starts the new copy (a
+ * temporary file), SYNC makes what has been saved durable (fsync), END puts the
+ * new copy in place (rename) and ABORT drops it. The policy decides how often
+ * SYNC is requested:
+ *
+ *   YMODEM_SYNC_NONE   never, the OS writes the data back whenever it likes
+ *   YMODEM_SYNC_FILE   once per file, right before END
+ *   YMODEM_SYNC_GROUP  also every sync_bytes or sync_ms while receiving
+ *
+ * A delta transfer also writes a new copy: the chunks the sender skips are
+ * loaded from the old file, which loads keep reading until END, and saved into
+ * the new copy. The members of a packed batch get a new copy each, from the
+ * BEGIN before their first byte to the END after their last, and the container
+ * itself has none.
+ */
+
+enum {
+    SYNC_CLOSED,
+    SYNC_NEW_COPY,
+    SYNC_MEMBERS,
+};
+
+void ymodem_set_sync(ymodem_context *ctx, uint8_t policy, uint32_t group_bytes,
+                     uint16_t group_ms)
+{
+    ctx->sync_policy = policy;
+    ctx->sync_bytes = group_bytes;
+    ctx->sync_ms = group_ms;
+}
+
+// the file being written, NULL between the members of a packed batch
+static char *ymodem_commit_name(ymodem_context *ctx)
+{
+    #ifdef MODEM_XFER_PACK
+    if (ctx->flags & YMODEM_FLAG_PACK_ACTIVE) {
+        return __ymodem_unpack_name(ctx);
+    }
+    #endif
+    return ctx->file_name;
+}
+
+static int ymodem_commit_op(ymodem_context *ctx, char *name, uint8_t op)
+{
+    int res;
+
+    if (op & MODEM_XFER_COMMIT_SYNC) {
+        ctx->sync_pending = 0;
+        ctx->sync_last_ms = modem_xfer_clock_ms();
+    }
+    dbg("%02X: commit '%s' %02X\n", ctx->seqno, name, op);
+    res = modem_xfer_commit(name, op);
+    if (res != MODEM_XFER_RES_OK) {
+        err("can't commit '%s' (%d)\n", name, res);
+    }
+
+    return res;
+}
+
+/*
+ * Open a file, called once its header has been accepted
+ */
+int __ymodem_commit_begin(ymodem_context *ctx)
+{
+    ctx->sync_pending = 0;
+    ctx->sync_last_ms = modem_xfer_clock_ms();
+    if (ctx->flags & YMODEM_FLAG_PACK_ACTIVE) {
+        // the members are opened one by one
+        ctx->sync_stat = SYNC_MEMBERS;
+        return MODEM_XFER_RES_OK;
+    }
+    ctx->sync_stat = SYNC_NEW_COPY;
+
+    return ymodem_commit_op(ctx, ctx->file_name, MODEM_XFER_COMMIT_BEGIN);
+}
+
+/*
+ * Open or close a member of a packed batch
+ */
+int __ymodem_commit_member(ymodem_context *ctx, char *name, int end)
+{
+    if (!end) {
+        return ymodem_commit_op(ctx, name, MODEM_XFER_COMMIT_BEGIN);
+    }
+    if (ctx->sync_policy == YMODEM_SYNC_NONE) {
+        return ymodem_commit_op(ctx, name, MODEM_XFER_COMMIT_END);
+    }
+
+    return ymodem_commit_op(ctx, name, MODEM_XFER_COMMIT_SYNC | MODEM_XFER_COMMIT_END);
+}
+
+/*
+ * Call after each block from ymodem_receive_block() has been saved, and with
+ * n == 0 at the end of each file (YMODEM_FLAG_EOF_BLOCK is required).
+ */
+int ymodem_commit(ymodem_context *ctx, unsigned int n)
+{
+    uint8_t op = 0;
+    char *name;
+
+    if (ctx->sync_stat == SYNC_CLOSED) {
+        return MODEM_XFER_RES_OK;
+    }
+    if (n == 0) {
+        if (ctx->sync_policy != YMODEM_SYNC_NONE && !(ctx->flags & YMODEM_FLAG_PACK_ACTIVE)) {
+            op |= MODEM_XFER_COMMIT_SYNC;
+        }
+        if (ctx->sync_stat == SYNC_NEW_COPY) {
+            op |= MODEM_XFER_COMMIT_END;
+        }
+        ctx->sync_stat = SYNC_CLOSED;
+        return op ? ymodem_commit_op(ctx, ctx->file_name, op) : MODEM_XFER_RES_OK;
+    }
+    if (ctx->sync_policy != YMODEM_SYNC_GROUP) {
+        return MODEM_XFER_RES_OK;
+    }
+    ctx->sync_pending += n;
+    name = ymodem_commit_name(ctx);
+    if (name == NULL) {
+        return MODEM_XFER_RES_OK;
+    }
+    if ((ctx->sync_bytes != 0 && ctx->sync_bytes <= ctx->sync_pending) ||
+        (ctx->sync_ms != 0 && modem_xfer_expired(ctx->sync_last_ms + ctx->sync_ms))) {
+        return ymodem_commit_op(ctx, name, MODEM_XFER_COMMIT_SYNC);
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+/*
+ * Drop the file being received, the old copy stays as it was
+ */
+void ymodem_commit_abort(ymodem_context *ctx)
+{
+    char *name = ymodem_commit_name(ctx);
+
+    if (ctx->sync_stat != SYNC_CLOSED && name != NULL &&
+        (ctx->sync_stat == SYNC_NEW_COPY || (ctx->flags & YMODEM_FLAG_PACK_ACTIVE))) {
+        ymodem_commit_op(ctx, name, MODEM_XFER_COMMIT_ABORT);
+    }
+    ctx->sync_stat = SYNC_CLOSED;
+}
+
+#endif  // MODEM_XFER_DURABLE && !MODEM_XFER_NO_RECEIVE
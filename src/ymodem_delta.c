@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <string.h>
+
+//#define DEBUG
+
+#include "modem_xfer_debug.h"
+#include "ymodem.h"
+
+#ifdef MODEM_XFER_DELTA
+
+/*
+ * Delta transfer
+ *
+ * A sender with YMODEM_FLAG_DELTA adds a "delta" token to the header
+ * extensions. A receiver with YMODEM_FLAG_DELTA that already has a file of
+ * that name answers the header with DREQ instead of REQ and sends the
+ * signatures of its copy, YMODEM_DELTA_CHUNK bytes per signature, in regular
+ * SOH frames numbered from 0:
+ *
+ *   payload[0]      number of signatures in this frame
+ *   payload[1]      kind of the signatures, DELTA_SIG_*
+ *   payload[8 + sn] weak checksum (32 bit LE) and a strong one of s - 4 bytes
+ *
+ * and then REQ as usual. Classic peers never see DREQ or the signatures.
+ *
+ * The strong checksum is the first 16 bytes of the SHA-256 of the chunk in a
+ * build with MODEM_XFER_SHA256 (DELTA_SIG_SHA256, 6 signatures per frame).
+ * Otherwise it is a CRC-32 (DELTA_SIG_CRC32, 15 per frame), which a changed
+ * chunk may match by chance or by design, so the receiver only takes a delta
+ * transfer along with the crc32 of the whole file, and fails the file if the
+ * crc32 of what it put together differs. A sender which can't compute the
+ * kind the receiver sent ignores the signatures and sends the whole file.
+ *
+ * The sender then sends each unchanged chunk as a SKP frame instead of data
+ * frames. A SKP frame carries a 16 bit block count (LE) and a CRC-16 and
+ * moves the receiver's file offset forward by that many blocks. Consecutive
+ * unchanged chunks are merged into one SKP frame.
+ *
+ * The weak checksum is an Adler-style rolling sum, so it could also be used
+ * to find moved data; matching is done at the same offset only, since
+ * modem_xfer_save() writes the file in place.
+ */
+
+typedef struct {
+    uint32_t a;
+    uint32_t b;
+    uint32_t crc;
+    #ifdef MODEM_XFER_SHA256
+    modem_xfer_sha256 sha;
+    #endif
+} delta_sig;
+
+// bytes of a signature of this kind, 0 for one this build can't compute
+static unsigned int sig_size(uint8_t type)
+{
+    if (type == DELTA_SIG_CRC32) {
+        return DELTA_SIG_CRC32_SIZE;
+    }
+    #ifdef MODEM_XFER_SHA256
+    if (type == DELTA_SIG_SHA256) {
+        return DELTA_SIG_SHA256_SIZE;
+    }
+    #endif
+
+    return 0;
+}
+
+static void sig_init(delta_sig *sig, uint8_t type)
+{
+    sig->a = 0;
+    sig->b = 0;
+    sig->crc = 0;
+    #ifdef MODEM_XFER_SHA256
+    if (type == DELTA_SIG_SHA256) {
+        modem_xfer_sha256_init(&sig->sha);
+    }
+    #endif
+}
+
+static void sig_update(delta_sig *sig, uint8_t type, const uint8_t *p, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        sig->a += p[i];
+        sig->b += sig->a;
+    }
+    #ifdef MODEM_XFER_SHA256
+    if (type == DELTA_SIG_SHA256) {
+        modem_xfer_sha256_update(&sig->sha, p, n);
+        return;
+    }
+    #endif
+    sig->crc = modem_xfer_crc32(sig->crc, p, n);
+}
+
+static void sig_encode(const delta_sig *sig, uint8_t type, uint8_t out[YMODEM_DELTA_SIG_SIZE])
+{
+    uint32_t weak = ((sig->b & 0xffff) << 16) | (sig->a & 0xffff);
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        out[i + 0] = (uint8_t)(weak >> (i * 8));
+        out[i + 4] = (uint8_t)(sig->crc >> (i * 8));
+    }
+    #ifdef MODEM_XFER_SHA256
+    if (type == DELTA_SIG_SHA256) {
+        uint8_t digest[32];
+
+        modem_xfer_sha256_final(&sig->sha, digest);
+        memcpy(&out[4], digest, DELTA_SIG_SHA256_SIZE - 4);
+    }
+    #endif
+}
+
+#ifndef MODEM_XFER_NO_RECEIVE
+/*
+ * Receiver side
+ */
+int __ymodem_delta_send_sigs(ymodem_context *ctx)
+{
+    uint8_t tmp[BUFSIZE];
+    uint8_t *buf = ctx->buf;
+    uint8_t seqno = ctx->seqno;
+    uint32_t offset = 0;
+    unsigned int len;
+    delta_sig sig;
+    #ifdef MODEM_XFER_SHA256
+    uint8_t type = DELTA_SIG_SHA256;
+    #else
+    uint8_t type = DELTA_SIG_CRC32;
+    #endif
+    unsigned int size = sig_size(type);
+    int n, eof = 0;
+    int res = MODEM_XFER_RES_OK;
+
+    dbg("%02X: %s: '%s'\n", ctx->seqno, __func__, ctx->file_name);
+    modem_xfer_tx(DREQ);
+    ctx->seqno = 0;
+    while (!eof && res == MODEM_XFER_RES_OK) {
+        memset(buf, 0x00, BUFSIZE);
+        buf[1] = type;
+        while (buf[0] < (BUFSIZE - 8) / size && !eof) {
+            sig_init(&sig, type);
+            for (len = 0; len < YMODEM_DELTA_CHUNK; len += n) {
+                n = modem_xfer_load(ctx->file_name, offset + len, tmp, sizeof(tmp));
+                if (n <= 0) {
+                    eof = 1;
+                    break;
+                }
+                sig_update(&sig, type, tmp, n);
+                if (n < (int)sizeof(tmp)) {
+                    len += n;
+                    eof = 1;
+                    break;
+                }
+            }
+            if (len == 0) {
+                break;
+            }
+            sig_encode(&sig, type, &buf[8 + buf[0] * size]);
+            buf[0]++;
+            offset += len;
+        }
+        if (buf[0] == 0) {
+            break;
+        }
+        res = __ymodem_send_frame(ctx, SOH, buf, BUFSIZE, modem_xfer_crc16(0, buf, BUFSIZE));
+    }
+    ctx->seqno = seqno;
+    if (offset == 0) {
+        // nothing to compare with, receive the whole file
+        ctx->flags &= ~YMODEM_FLAG_DELTA_ACTIVE;
+    }
+    dbg("%02X: %s: %lu bytes of signatures\n", ctx->seqno, __func__, (unsigned long)offset);
+
+    return res;
+}
+
+int __ymodem_delta_recv_skip(ymodem_context *ctx)
+{
+    uint8_t buf[7];  // SKP seqno ~seqno count (16 LE) crc16, no frame buffer needed
+    uint8_t tmp[BUFSIZE];
+    uint16_t count;
+    uint32_t offset, end;
+    int n;
+
+    if (YMODEM_RECV(ctx, &buf[1], 6, YMODEM_DEADLINE(ctx, 6, 1000)) != 6) {
+        dbg("%02X: %s: timeout\n", ctx->seqno, __func__);
+        return MODEM_XFER_RES_TIMEOUT;
+    }
+    if (buf[2] != (uint8_t)~buf[1] || modem_xfer_crc16(0, &buf[3], 2) != buf[5] * 256 + buf[6]) {
+        dbg("%02X: %s: broken frame\n", ctx->seqno, __func__);
+        return MODEM_XFER_RES_EPTOROCOL;
+    }
+    if (buf[1] == (uint8_t)(ctx->seqno - 1)) {
+        // our ACK was lost
+        dbg("%02X: %s: duplicate\n", ctx->seqno, __func__);
+        modem_xfer_tx(ACK);
+        return MODEM_XFER_RES_OK;
+    }
+    if (buf[1] != ctx->seqno) {
+        dbg("%02X: %s: invalid sequence number %02X\n", ctx->seqno, __func__, buf[1]);
+        return MODEM_XFER_RES_ESEQUENCE;
+    }
+    count = buf[3] | (buf[4] << 8);
+    modem_xfer_tx(ACK);
+    dbg("%02X: %s: skip %u blocks at %lu\n", ctx->seqno, __func__, count,
+        (unsigned long)ctx->file_offset);
+
+    // keep the file digest covering the data we already have
+    offset = ctx->file_offset;
+    end = offset + (uint32_t)count * BUFSIZE;
+    if (ctx->file_size != 0 && ctx->file_size < end) {
+        end = ctx->file_size;
+    }
+    while (offset < end) {
+        n = modem_xfer_load(ctx->file_name, offset,
+                            tmp, end - offset < sizeof(tmp) ? end - offset : sizeof(tmp));
+        if (n <= 0) {
+            break;
+        }
+        modem_xfer_digest_update(ctx, tmp, n);
+        #ifdef MODEM_XFER_DURABLE
+        // loads still read the old copy, saves go to the new one
+        if (modem_xfer_save(ctx->file_name, offset, tmp, (uint16_t)n) != MODEM_XFER_RES_OK) {
+            err("can't copy '%s' at %lu\n", ctx->file_name, (unsigned long)offset);
+            return MODEM_XFER_RES_EIO;
+        }
+        #endif
+        offset += n;
+    }
+
+    ctx->file_offset += (uint32_t)count * BUFSIZE;
+    ctx->seqno++;
+
+    return MODEM_XFER_RES_OK;
+}
+
+#endif  // MODEM_XFER_NO_RECEIVE
+
+#ifndef MODEM_XFER_NO_SEND
+/*
+ * Sender side
+ */
+void ymodem_send_delta_init(ymodem_context *ctx, uint8_t *sigs, uint32_t size)
+{
+    ctx->flags |= YMODEM_FLAG_DELTA;
+    ctx->delta_sigs = sigs;
+    ctx->delta_sigs_size = size;
+    ctx->delta_num_sigs = 0;
+    ctx->delta_skip = 0;
+}
+
+int __ymodem_delta_recv_sigs(ymodem_context *ctx)
+{
+    uint8_t *buf = ctx->buf;
+    uint8_t crc_buf[2];
+    uint8_t seqno = 0;
+    int i, retry = 0;
+    unsigned int size;
+    uint32_t frame_deadline;
+
+    dbg("%02X: %s:\n", ctx->seqno, __func__);
+    ctx->delta_num_sigs = 0;
+    while (retry < 5) {
+        if (__ymodem_canceled(ctx)) {
+            return MODEM_XFER_RES_CANCELED;
+        }
+        if (YMODEM_RECV(ctx, buf, 1, modem_xfer_clock_ms() + 5000) != 1) {
+            retry++;
+            continue;
+        }
+        if (__ymodem_is_req(ctx, buf[0])) {
+            dbg("%02X: %s: %lu signatures\n", ctx->seqno, __func__,
+                (unsigned long)ctx->delta_num_sigs);
+            if (0 < ctx->delta_num_sigs) {
+                ctx->flags |= YMODEM_FLAG_DELTA_ACTIVE;
+            }
+            return MODEM_XFER_RES_OK;
+        }
+        if (buf[0] == CAN) {
+            return MODEM_XFER_RES_CANCELED;
+        }
+        #ifdef MODEM_XFER_FEC
+        if (YMODEM_IS_FREQ(ctx, buf[0])) {
+            // the start byte follows the signatures and FREQ
+            ctx->fec_active = ctx->fec_parity;
+            continue;
+        }
+        #endif
+        frame_deadline = YMODEM_DEADLINE(ctx, 2 + BUFSIZE + 2, 1000);
+        if (buf[0] != SOH ||
+            YMODEM_RECV(ctx, &buf[1], 2, frame_deadline) != 2 ||
+            buf[2] != (uint8_t)~buf[1]) {
+            goto retry;
+        }
+        uint8_t seq = buf[1];
+        if (YMODEM_RECV(ctx, buf, BUFSIZE, frame_deadline) != BUFSIZE ||
+            YMODEM_RECV(ctx, crc_buf, 2, frame_deadline) != 2 ||
+            modem_xfer_crc16(0, buf, BUFSIZE) != crc_buf[0] * 256 + crc_buf[1]) {
+            goto retry;
+        }
+        if (seq == (uint8_t)(seqno - 1)) {
+            // duplicate, our ACK was lost
+            modem_xfer_tx(ACK);
+            continue;
+        }
+        if (seq != seqno) {
+            goto retry;
+        }
+        // a kind we can't compute leaves no signature, and the file is sent as it is
+        ctx->delta_sig_type = buf[1];
+        size = sig_size(buf[1]);
+        for (i = 0; size != 0 && i < buf[0] && (unsigned int)i < (BUFSIZE - 8) / size; i++) {
+            uint32_t pos = ctx->delta_num_sigs * YMODEM_DELTA_SIG_SIZE;
+            if (ctx->delta_sigs_size < pos + YMODEM_DELTA_SIG_SIZE) {
+                // no room, the remaining chunks will be sent as they are
+                break;
+            }
+            memcpy(&ctx->delta_sigs[pos], &buf[8 + i * size], size);
+            ctx->delta_num_sigs++;
+        }
+        seqno++;
+        retry = 0;
+        modem_xfer_tx(ACK);
+        continue;
+    retry:
+        modem_xfer_discard_poll(&ctx->cancel_req);
+        modem_xfer_tx(NAK);
+        retry++;
+    }
+
+    return MODEM_XFER_RES_TIMEOUT;
+}
+
+int __ymodem_delta_flush_skip(ymodem_context *ctx)
+{
+    uint8_t payload[2];
+    int res;
+
+    if (ctx->delta_skip == 0) {
+        return MODEM_XFER_RES_OK;
+    }
+    payload[0] = ctx->delta_skip & 0xff;
+    payload[1] = ctx->delta_skip >> 8;
+    res = __ymodem_send_frame(ctx, SKP, payload, sizeof(payload),
+                              modem_xfer_crc16(0, payload, sizeof(payload)));
+    if (res == MODEM_XFER_RES_OK) {
+        ctx->delta_skip = 0;
+    }
+
+    return res;
+}
+
+int ymodem_send_delta_chunk(ymodem_context *ctx, const uint8_t *data, unsigned int n)
+{
+    uint32_t index = ctx->file_offset / YMODEM_DELTA_CHUNK;
+    uint8_t sig_buf[YMODEM_DELTA_SIG_SIZE];
+    unsigned int len;
+    delta_sig sig;
+    int res;
+
+    if ((ctx->flags & YMODEM_FLAG_DELTA_ACTIVE) && index < ctx->delta_num_sigs &&
+        ctx->file_offset % YMODEM_DELTA_CHUNK == 0) {
+        sig_init(&sig, ctx->delta_sig_type);
+        sig_update(&sig, ctx->delta_sig_type, data, n);
+        sig_encode(&sig, ctx->delta_sig_type, sig_buf);
+        if (memcmp(sig_buf, &ctx->delta_sigs[index * YMODEM_DELTA_SIG_SIZE],
+                   sig_size(ctx->delta_sig_type)) == 0) {
+            len = (n + BUFSIZE - 1) / BUFSIZE;
+            if (0xffff - ctx->delta_skip < len) {
+                res = __ymodem_delta_flush_skip(ctx);
+                if (res != MODEM_XFER_RES_OK) {
+                    return res;
+                }
+            }
+            ctx->delta_skip += len;
+            ctx->file_offset += len * BUFSIZE;
+            modem_xfer_digest_update(ctx, data, n);
+            return MODEM_XFER_RES_OK;
+        }
+    }
+
+    res = __ymodem_delta_flush_skip(ctx);
+    while (res == MODEM_XFER_RES_OK && 0 < n) {
+        len = n < BUFSIZE ? n : BUFSIZE;
+        memcpy(ctx->buf, data, len);
+        memset(&ctx->buf[len], 0x1a, BUFSIZE - len);
+        res = ymodem_send_block(ctx);
+        data += len;
+        n -= len;
+    }
+
+    return res;
+}
+
+#endif  // MODEM_XFER_NO_SEND
+
+#endif  // MODEM_XFER_DELTA
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <modem_xfer.h>
+#include <string.h>
+
+//#define DEBUG
+
+#include "modem_xfer_debug.h"
+#include "ymodem.h"
+
+#ifdef MODEM_XFER_PACK
+
+/*
+ * Batch packing
+ *
+ * Many small files are sent as a single YMODEM file (the container) whose
+ * header carries a "pack" extension token. The container is a stream of
+ * entries without any padding between them:
+ *
+ *   +-----+----------------+--------------+----------------+
+ *   | len | name (len)     | size (32 LE) | data (size)    |
+ *   +-----+----------------+--------------+----------------+
+ *
+ * terminated by an entry with len 0. Only the last block of the container is
+ * padded, so a batch costs one header, one EOT and the bytes of the files.
+ * The sender packs only for a receiver which agreed on YMODEM_CAP_PACK, which
+ * it learns from the start byte following an earlier header of the session.
+ * Until then, or for a classic receiver, ymodem_send_pack_*() send each member
+ * as a file of its own with the same calls.
+ *
+ * A name is at most YMODEM_PACK_NAME_MAX bytes and names a file in the
+ * current directory, and a member never runs past the end of the container.
+ * The receiver fails the batch on anything else rather than guess.
+ */
+
+enum {
+    PACK_NAME_LEN,
+    PACK_NAME,
+    PACK_SIZE,
+    PACK_DATA,
+    PACK_END,
+    PACK_SPLIT,  // sender: each member is a file of its own
+};
+
+uint32_t ymodem_pack_entry_size(const char *file_name, uint32_t size)
+{
+    return 1 + strlen(file_name) + 4 + size;
+}
+
+#ifndef MODEM_XFER_NO_RECEIVE
+/*
+ * Receiver side
+ */
+void __ymodem_unpack_init(ymodem_context *ctx)
+{
+    ctx->pack.state = PACK_NAME_LEN;
+}
+
+int ymodem_unpack_end(ymodem_context *ctx)
+{
+    if (ctx->pack.state != PACK_END) {
+        err("'%s' ended before the end of the batch\n", ctx->file_name);
+        return MODEM_XFER_RES_EPTOROCOL;
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+// the member being written, if any
+char *__ymodem_unpack_name(ymodem_context *ctx)
+{
+    return ctx->pack.state == PACK_DATA ? ctx->pack.name : NULL;
+}
+
+int ymodem_unpack(ymodem_context *ctx, uint8_t *buf, unsigned int n)
+{
+    ymodem_pack *pk = &ctx->pack;
+    const uint8_t *start = buf;
+    unsigned int len;
+    int res;
+
+    while (0 < n) {
+        switch (pk->state) {
+        case PACK_NAME_LEN:
+            pk->len = *buf++;
+            n--;
+            pk->pos = 0;
+            if (YMODEM_PACK_NAME_MAX < pk->len) {
+                err("%u bytes long member name\n", pk->len);
+                return MODEM_XFER_RES_EPTOROCOL;
+            }
+            pk->state = pk->len == 0 ? PACK_END : PACK_NAME;
+            break;
+        case PACK_NAME:
+            pk->name[pk->pos] = *buf++;
+            n--;
+            if (++pk->pos == pk->len) {
+                pk->name[pk->len] = '\0';
+                if (strlen(pk->name) != pk->len || !modem_xfer_name_ok(pk->name)) {
+                    err("invalid member name '%s'\n", pk->name);
+                    return MODEM_XFER_RES_EPTOROCOL;
+                }
+                pk->pos = 0;
+                pk->size = 0;
+                pk->state = PACK_SIZE;
+            }
+            break;
+        case PACK_SIZE:
+            pk->size |= (uint32_t)*buf++ << (pk->pos * 8);
+            n--;
+            if (++pk->pos == 4) {
+                // the bytes of the container after this entry header
+                uint32_t left = ctx->file_size - ctx->file_offset - (uint32_t)(buf - start);
+                if (ctx->file_size != 0 && left < pk->size) {
+                    err("'%s' has %lu bytes, %lu left in the batch\n", pk->name,
+                        (unsigned long)pk->size, (unsigned long)left);
+                    return MODEM_XFER_RES_EPTOROCOL;
+                }
+                info("unpacking file '%s', %lu bytes\n", pk->name, (unsigned long)pk->size);
+                #ifdef MODEM_XFER_DURABLE
+                res = __ymodem_commit_member(ctx, pk->name, 0);
+                if (res != MODEM_XFER_RES_OK) {
+                    return res;
+                }
+                #endif
+                pk->offset = 0;
+                pk->state = PACK_DATA;
+            }
+            break;
+        case PACK_DATA:
+            len = pk->size - pk->offset < n ? pk->size - pk->offset : n;
+            if (0 < len) {
+                res = modem_xfer_save(pk->name, pk->offset, buf, len);
+                if (res != MODEM_XFER_RES_OK) {
+                    return res;
+                }
+                buf += len;
+                n -= len;
+                pk->offset += len;
+            }
+            if (pk->offset == pk->size) {
+                // truncate an older and longer copy
+                res = modem_xfer_save(pk->name, pk->size, NULL, 0);
+                #ifdef MODEM_XFER_DURABLE
+                if (res == MODEM_XFER_RES_OK) {
+                    res = __ymodem_commit_member(ctx, pk->name, 1);
+                }
+                #endif
+                if (res != MODEM_XFER_RES_OK) {
+                    return res;
+                }
+                pk->state = PACK_NAME_LEN;
+            }
+            break;
+        default:
+            // padding after the end of the container
+            return MODEM_XFER_RES_OK;
+        }
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+#endif  // MODEM_XFER_NO_RECEIVE
+
+#ifndef MODEM_XFER_NO_SEND
+/*
+ * Sender side
+ */
+static int pack_append(ymodem_context *ctx, const uint8_t *data, unsigned int n)
+{
+    unsigned int len;
+    int res;
+
+    while (0 < n) {
+        len = BUFSIZE - ctx->pack.pos < n ? BUFSIZE - ctx->pack.pos : n;
+        memcpy(&ctx->buf[ctx->pack.pos], data, len);
+        ctx->pack.pos += len;
+        data += len;
+        n -= len;
+        if (ctx->pack.pos == BUFSIZE) {
+            res = ymodem_send_block(ctx);
+            if (res != MODEM_XFER_RES_OK) {
+                return res;
+            }
+            ctx->pack.pos = 0;
+        }
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+// pad and send what is left of the last block
+static int pack_flush(ymodem_context *ctx)
+{
+    int res = MODEM_XFER_RES_OK;
+
+    if (ctx->pack.pos != 0) {
+        memset(&ctx->buf[ctx->pack.pos], 0x1a, BUFSIZE - ctx->pack.pos);
+        res = ymodem_send_block(ctx);
+        ctx->pack.pos = 0;
+    }
+
+    return res;
+}
+
+int ymodem_send_pack_begin(ymodem_context *ctx, char *pack_name, uint32_t size)
+{
+    // it also keeps the members from offering delta
+    ctx->flags |= YMODEM_FLAG_PACK_ACTIVE;
+    ctx->pack.pos = 0;
+    if (!(ctx->peer_caps & YMODEM_CAP_PACK)) {
+        info("sending the files of '%s' one by one\n", pack_name);
+        ctx->pack.state = PACK_SPLIT;
+        return MODEM_XFER_RES_OK;
+    }
+    ctx->pack.state = PACK_DATA;
+
+    return __ymodem_send_header_ext(ctx, pack_name, size, "pack");
+}
+
+int ymodem_send_pack_file(ymodem_context *ctx, char *file_name, uint32_t size)
+{
+    uint8_t hdr[4];
+    uint8_t len = (uint8_t)strlen(file_name);
+    int res;
+
+    if (!(ctx->flags & YMODEM_FLAG_PACK_ACTIVE)) {
+        return MODEM_XFER_RES_ESEQUENCE;
+    }
+    // a receiver would fail the whole batch on this name
+    if (YMODEM_PACK_NAME_MAX < strlen(file_name) || !modem_xfer_name_ok(file_name)) {
+        err("%s: can't pack '%s'\n", __func__, file_name);
+        return MODEM_XFER_RES_EPTOROCOL;
+    }
+    dbg("%02X: %s: '%s' %lu\n", ctx->seqno, __func__, file_name, (unsigned long)size);
+    if (ctx->pack.state == PACK_SPLIT) {
+        res = pack_flush(ctx);
+        if (res == MODEM_XFER_RES_OK) {
+            res = ymodem_send_header(ctx, file_name, size);
+        }
+        return res;
+    }
+    hdr[0] = (uint8_t)(size >> 0);
+    hdr[1] = (uint8_t)(size >> 8);
+    hdr[2] = (uint8_t)(size >> 16);
+    hdr[3] = (uint8_t)(size >> 24);
+    res = pack_append(ctx, &len, 1);
+    if (res == MODEM_XFER_RES_OK) {
+        res = pack_append(ctx, (uint8_t *)file_name, len);
+    }
+    if (res == MODEM_XFER_RES_OK) {
+        res = pack_append(ctx, hdr, sizeof(hdr));
+    }
+
+    return res;
+}
+
+int ymodem_send_pack_data(ymodem_context *ctx, const uint8_t *data, unsigned int n)
+{
+    if (!(ctx->flags & YMODEM_FLAG_PACK_ACTIVE)) {
+        return MODEM_XFER_RES_ESEQUENCE;
+    }
+
+    return pack_append(ctx, data, n);
+}
+
+int ymodem_send_pack_end(ymodem_context *ctx)
+{
+    uint8_t end = 0;
+    int res;
+
+    if (!(ctx->flags & YMODEM_FLAG_PACK_ACTIVE)) {
+        return MODEM_XFER_RES_ESEQUENCE;
+    }
+    if (ctx->pack.state != PACK_SPLIT) {
+        res = pack_append(ctx, &end, 1);
+    } else {
+        res = MODEM_XFER_RES_OK;
+    }
+    if (res == MODEM_XFER_RES_OK) {
+        res = pack_flush(ctx);
+    }
+    ctx->flags &= ~YMODEM_FLAG_PACK_ACTIVE;
+
+    return res;
+}
+
+#endif  // MODEM_XFER_NO_SEND
+
+#endif  // MODEM_XFER_PACK
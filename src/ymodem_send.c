@@ -22,7 +22,6 @@
  */
 
 #include <modem_xfer.h>
-#include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdarg.h>
@@ -33,6 +32,7 @@
 #include "modem_xfer_debug.h"
 #include "ymodem.h"
 
+#ifndef MODEM_XFER_NO_SEND
 static int __ymodem_send_block(ymodem_context *ctx);
 
 void ymodem_send_init(ymodem_context *ctx, uint8_t buf[MODEM_XFER_BUF_SIZE])
@@ -43,6 +43,23 @@ void ymodem_send_init(ymodem_context *ctx, uint8_t buf[MODEM_XFER_BUF_SIZE])
     ctx->num_files_xfered = 0;
     ctx->seqno = 0;
     ctx->num_bytes_xfered = 0;
+    ctx->flags = 0;
+    ctx->baud = MODEM_XFER_BAUD;
+    ctx->cancel_req = 0;
+    ctx->caps = YMODEM_CAPS_DEFAULT;
+    ctx->peer_caps = 0;
+    #ifdef MODEM_XFER_DELTA
+    // the end of every file flushes pending skips, delta or not
+    ctx->delta_sigs = NULL;
+    ctx->delta_sigs_size = 0;
+    ctx->delta_num_sigs = 0;
+    ctx->delta_skip = 0;
+    ctx->delta_sig_type = DELTA_SIG_CRC32;
+    #endif
+    #ifdef MODEM_XFER_FEC
+    ctx->fec_parity = 0;
+    ctx->fec_active = 0;
+    #endif
 }
 
 int ymodem_send_eot(ymodem_context *ctx)
@@ -52,9 +69,12 @@ int ymodem_send_eot(ymodem_context *ctx)
     int retry = 5;
 
     while (0 < retry--) {
+        if (__ymodem_canceled(ctx)) {
+            return MODEM_XFER_RES_CANCELED;
+        }
         dbg("%02X: %s: send EOT (1/2)\n",  ctx->seqno, __func__);
         modem_xfer_tx(EOT);
-        n = modem_xfer_recv_bytes(&buf[0], 1, 5000);
+        n = __ymodem_recv_answer(ctx, &buf[0], 0);
         if (n != 1) {
             dbg("%02X: %s: timeout\n",  ctx->seqno, __func__);
             continue;
@@ -75,7 +95,7 @@ int ymodem_send_eot(ymodem_context *ctx)
         dbg("%02X: %s: received NAK\n",  ctx->seqno, __func__);
         dbg("%02X: %s: send EOT (2/2)\n",  ctx->seqno, __func__);
         modem_xfer_tx(EOT);
-        n = modem_xfer_recv_bytes(&buf[0], 1, 5000);
+        n = __ymodem_recv_answer(ctx, &buf[0], 0);
         if (n != 1) {
             dbg("%02X: %s: timeout\n",  ctx->seqno, __func__);
             continue;
@@ -95,33 +115,162 @@ int ymodem_send_eot(ymodem_context *ctx)
     return MODEM_XFER_RES_TIMEOUT;
 }
 
+#endif  // MODEM_XFER_NO_SEND
+
 void ymodem_send_cancel(ymodem_context *ctx)
 {
     uint8_t buf[1];
+
+    if (ctx->flags & YMODEM_FLAG_CAN_SENT) {
+        return;
+    }
+    ymodem_send_cancel_nowait(ctx);
+    modem_xfer_rx_poll(buf, modem_xfer_clock_ms() + 1000, &ctx->cancel_req);
+}
+
+void ymodem_send_cancel_nowait(ymodem_context *ctx)
+{
     dbg("%02X: %s:\n",  ctx->seqno, __func__);
     info("cancel\n");
     modem_xfer_tx(CAN);
     modem_xfer_tx(CAN);
-    modem_xfer_rx(buf, 1000);
 }
 
+/*
+ * May be called from another thread or an ISR. Every wait of the engine polls
+ * the request at least each MODEM_XFER_POLL_MS, and the pending call returns
+ * MODEM_XFER_RES_CANCELED after sending CAN CAN.
+ */
+void ymodem_request_cancel(ymodem_context *ctx)
+{
+    ctx->cancel_req = 1;
+}
+
+/*
+ * A receiver which understood our caps token answers with the common set
+ * instead of 'C', which is never more than we offered
+ */
+int __ymodem_is_start(ymodem_context *ctx, uint8_t c)
+{
+    if (c == REQ) {
+        return 1;
+    }
+
+    return (ctx->flags & YMODEM_FLAG_CAPS) && (c & 0x80) && (c & 0x7f & ~ctx->caps) == 0;
+}
+
+int __ymodem_is_req(ymodem_context *ctx, uint8_t c)
+{
+    if (!__ymodem_is_start(ctx, c)) {
+        return 0;
+    }
+    if (c != REQ) {
+        ctx->peer_caps = c & 0x7f;
+    }
+
+    return 1;
+}
+
+/*
+ * What a receiver which took our header sends after the ACK, which was lost
+ */
+static int __ymodem_header_taken(ymodem_context *ctx, uint8_t c)
+{
+    #ifdef MODEM_XFER_DELTA
+    if (c == DREQ && (ctx->flags & YMODEM_FLAG_DELTA)) {
+        return 1;
+    }
+    #endif
+    #ifdef MODEM_XFER_FEC
+    if (YMODEM_IS_FREQ(ctx, c)) {
+        return 1;
+    }
+    #endif
+
+    // the start byte with caps, as a plain 'C' may still be from before the header
+    return c != REQ && __ymodem_is_start(ctx, c);
+}
+
+/*
+ * Wait for the answer to a frame or EOT. The receiver repeats its start byte
+ * until something arrives, so stale ones may still come first. Taken as NAKs,
+ * each would cost a retransmission and each of those an extra ACK, which the
+ * next frame would take as its own, so they are skipped. A header is the one
+ * frame which is also answered by what follows it, once its ACK was lost.
+ */
+int __ymodem_recv_answer(ymodem_context *ctx, uint8_t *c, int header)
+{
+    uint32_t deadline = modem_xfer_clock_ms() + 5000;
+
+    while (YMODEM_RECV(ctx, c, 1, deadline) == 1) {
+        if (header && __ymodem_header_taken(ctx, *c)) {
+            return 1;
+        }
+        if (__ymodem_is_start(ctx, *c)) {
+            dbg("%02X: %s: skip start byte 0x%02x\n",  ctx->seqno, __func__, *c);
+            continue;
+        }
+        #ifdef MODEM_XFER_FEC
+        if (YMODEM_IS_FREQ(ctx, *c)) {
+            continue;
+        }
+        #endif
+        return 1;
+    }
+
+    return 0;
+}
+
+int __ymodem_canceled(ymodem_context *ctx)
+{
+    if (!ctx->cancel_req) {
+        return 0;
+    }
+    if (!(ctx->flags & YMODEM_FLAG_CAN_SENT)) {
+        ymodem_send_cancel_nowait(ctx);
+        ctx->flags |= YMODEM_FLAG_CAN_SENT;
+    }
+
+    return 1;
+}
+
+#ifndef MODEM_XFER_NO_SEND
 int ymodem_send_wait_req(ymodem_context *ctx, int timeout_sec)
 {
     int n;
     uint8_t buf[1];
-    int retry = 0;
+    // line noise must not stretch the wait, so it ends at an absolute deadline
+    uint32_t deadline = modem_xfer_clock_ms() + (uint32_t)timeout_sec * 1000;
 
     dbg("%02X: %s:\n",  ctx->seqno, __func__);
-    while (timeout_sec == 0 || retry++ < timeout_sec) {
-        n = modem_xfer_recv_bytes(&buf[0], 1, 1000);
+    while (timeout_sec == 0 || !modem_xfer_expired(deadline)) {
+        if (__ymodem_canceled(ctx)) {
+            return MODEM_XFER_RES_CANCELED;
+        }
+        n = YMODEM_RECV(ctx, &buf[0], 1, modem_xfer_clock_ms() + 1000);
         if (n != 1) {
             dbg("%02X: %s: timeout\n",  ctx->seqno, __func__);
             continue;
         }
-        if (buf[0] == REQ) {
-            dbg("%02X: %s: received REQ\n", ctx->seqno, __func__);
+        if (__ymodem_is_req(ctx, buf[0])) {
+            dbg("%02X: %s: received REQ %02X\n", ctx->seqno, __func__, buf[0]);
             return MODEM_XFER_RES_OK;
         }
+        #ifdef MODEM_XFER_FEC
+        if (ctx->stat == MODEM_XFER_STAT_XFER && YMODEM_IS_FREQ(ctx, buf[0])) {
+            // the start byte follows
+            dbg("%02X: %s: received FREQ\n", ctx->seqno, __func__);
+            ctx->fec_active = ctx->fec_parity;
+            continue;
+        }
+        #endif
+        #ifdef MODEM_XFER_DELTA
+        if (buf[0] == DREQ && ctx->stat == MODEM_XFER_STAT_XFER &&
+            (ctx->flags & YMODEM_FLAG_DELTA)) {
+            dbg("%02X: %s: received DREQ\n", ctx->seqno, __func__);
+            return __ymodem_delta_recv_sigs(ctx);
+        }
+        #endif
         if (buf[0] == CAN) {
             info("%02X: %s: received CAN 0x%02x\n", ctx->seqno, __func__, buf[0]);
             return MODEM_XFER_RES_CANCELED;
@@ -138,14 +287,22 @@ int ymodem_send_wait_req(ymodem_context *ctx, int timeout_sec)
     return MODEM_XFER_RES_TIMEOUT;
 }
 
-int ymodem_send_header(ymodem_context *ctx, char *file_name, uint32_t size)
+static int __ymodem_send_header(ymodem_context *ctx, const uint8_t *payload, uint16_t crc,
+                                char *file_name, uint32_t size)
 {
-    int n, res;
-    int retry = 5;
-    uint16_t crc;
+    int res;
     int timeout_sec = 5;
+    uint8_t buf[1];
+    uint8_t answer = ACK;
 
     if (ctx->stat == MODEM_XFER_STAT_XFER) {
+        #ifdef MODEM_XFER_DELTA
+        res = __ymodem_delta_flush_skip(ctx);
+        if (res != MODEM_XFER_RES_OK) {
+            return res;
+        }
+        ctx->flags &= ~YMODEM_FLAG_DELTA_ACTIVE;
+        #endif
         dbg("%02X: %s: send EOT\n",  ctx->seqno, __func__);
         res = ymodem_send_eot(ctx);
         if (res != MODEM_XFER_RES_OK) {
@@ -163,17 +320,26 @@ int ymodem_send_header(ymodem_context *ctx, char *file_name, uint32_t size)
     if (res != MODEM_XFER_RES_OK) {
         return res;
     }
+    // drop start bytes which a fast polling receiver queued meanwhile, but
+    // nothing else, as a cancel must not get lost among them
+    while (modem_xfer_rx(&buf[0], 0) == 1) {
+        if (buf[0] == CAN) {
+            dbg("%02X: %s: received CAN\n",  ctx->seqno, __func__);
+            return MODEM_XFER_RES_CANCELED;
+        }
+        if (!__ymodem_is_start(ctx, buf[0]) && buf[0] != DREQ && buf[0] != FREQ) {
+            dbg("%02X: %s: stop at 0x%02x\n",  ctx->seqno, __func__, buf[0]);
+            break;
+        }
+        dbg("%02X: %s: drop 0x%02x\n",  ctx->seqno, __func__, buf[0]);
+    }
 
     ctx->seqno = 0;
     dbg("%02X: %s: '%s' %lu\n",  ctx->seqno, __func__, file_name, (unsigned long)size);
-    memset(ctx->buf, 0x00, MODEM_XFER_BUF_SIZE);
-    if (size == MODEM_XFER_UNKNOWN_FILE_SIZE) {
-        snprintf((char *)ctx->buf, MODEM_XFER_BUF_SIZE, "%s%c", file_name, '\0');
-    } else {
-        snprintf((char *)ctx->buf, MODEM_XFER_BUF_SIZE, "%s%c%lu", file_name, '\0',
-                 (unsigned long)size);
-    }
-    res = __ymodem_send_block(ctx);
+    res = __ymodem_send_frame(ctx, SOH, payload, MODEM_XFER_BUF_SIZE, crc);
+    if (res < 0) {
+        answer = (uint8_t)-res;
+    } else
     if (res != MODEM_XFER_RES_OK) {
         return res;
     }
@@ -190,31 +356,153 @@ int ymodem_send_header(ymodem_context *ctx, char *file_name, uint32_t size)
         info("sending file '%s' ...\n", file_name);
     }
     ctx->stat = MODEM_XFER_STAT_XFER;
+    #ifdef MODEM_XFER_FEC
+    ctx->fec_active = 0;
+    #endif
+    ctx->file_size = size == MODEM_XFER_UNKNOWN_FILE_SIZE ? 0 : size;
+    ctx->file_offset = 0;
+    modem_xfer_digest_reset(ctx);
+    #ifdef MODEM_XFER_DELTA
+    if (answer == DREQ) {
+        return __ymodem_delta_recv_sigs(ctx);
+    }
+    #endif
+    #ifdef MODEM_XFER_FEC
+    if (answer == FREQ) {
+        // the start byte follows
+        ctx->fec_active = ctx->fec_parity;
+    }
+    #endif
+    if (answer != ACK && __ymodem_is_req(ctx, answer)) {
+        return MODEM_XFER_RES_OK;
+    }
     res = ymodem_send_wait_req(ctx, 5);
 
     return res;
 }
 
-static int __ymodem_send_block(ymodem_context *ctx)
+static void __ymodem_encode_header(uint8_t buf[MODEM_XFER_BUF_SIZE], char *file_name,
+                                   uint32_t size, const char *ext)
 {
-    int n, res;
+    unsigned int n = strlen(file_name);
+
+    memset(buf, 0x00, MODEM_XFER_BUF_SIZE);
+    if (MODEM_XFER_BUF_SIZE - 1 < n) {
+        n = MODEM_XFER_BUF_SIZE - 1;
+    }
+    memcpy(buf, file_name, n);
+    n++;
+    // the decimal size needs up to 10 digits and a NUL
+    if (size != MODEM_XFER_UNKNOWN_FILE_SIZE && n + 11 <= MODEM_XFER_BUF_SIZE) {
+        n += modem_xfer_utoa((char *)&buf[n], size);
+    }
+    // extensions go after the NUL of the file info string, where classic receivers ignore them
+    if (ext != NULL && n + 1 + strlen(ext) < MODEM_XFER_BUF_SIZE) {
+        strcpy((char *)&buf[n + 1], ext);
+    }
+}
+
+int __ymodem_send_header_ext(ymodem_context *ctx, char *file_name, uint32_t size,
+                             const char *token)
+{
+    char ext[48];
+    unsigned int n = 0;
+
+    // tokens are short literals built by this module, so ext never overflows
+    if (token != NULL) {
+        n = strlen(token);
+        memcpy(ext, token, n);
+    }
+    ext[n] = '\0';
+    #ifdef MODEM_XFER_DELTA
+    if ((ctx->flags & YMODEM_FLAG_DELTA) && !(ctx->flags & YMODEM_FLAG_PACK_ACTIVE) &&
+        file_name[0] != '\0') {
+        if (n != 0) {
+            ext[n++] = ' ';
+        }
+        memcpy(&ext[n], "delta", 6);
+        n += 5;
+    }
+    #endif
+    ctx->flags &= ~YMODEM_FLAG_CAPS;
+    if (ctx->caps != 0 && file_name[0] != '\0') {
+        if (n != 0) {
+            ext[n++] = ' ';
+        }
+        memcpy(&ext[n], "caps=", 5);
+        n += 5;
+        n += modem_xfer_utox(&ext[n], ctx->caps, 2);
+        ctx->flags |= YMODEM_FLAG_CAPS;
+    }
+    #ifdef MODEM_XFER_FEC
+    if (ctx->fec_parity != 0 && file_name[0] != '\0') {
+        if (n != 0) {
+            ext[n++] = ' ';
+        }
+        memcpy(&ext[n], "fec=", 4);
+        n += 4;
+        n += modem_xfer_utoa(&ext[n], ctx->fec_parity);
+    }
+    #endif
+    __ymodem_encode_header(ctx->buf, file_name, size, ext[0] ? ext : NULL);
+    return __ymodem_send_header(ctx, ctx->buf, modem_xfer_crc16(0, ctx->buf, MODEM_XFER_BUF_SIZE),
+                                file_name, size);
+}
+
+int ymodem_send_header(ymodem_context *ctx, char *file_name, uint32_t size)
+{
+    return __ymodem_send_header_ext(ctx, file_name, size, NULL);
+}
+
+int ymodem_send_header_crc32(ymodem_context *ctx, char *file_name, uint32_t size,
+                             uint32_t crc32)
+{
+    char ext[16];
+
+    memcpy(ext, "crc32=", 6);
+    modem_xfer_utox(&ext[6], crc32, 8);
+    return __ymodem_send_header_ext(ctx, file_name, size, ext);
+}
+
+#endif  // MODEM_XFER_NO_SEND
+
+int __ymodem_send_frame(ymodem_context *ctx, uint8_t type, const uint8_t *payload,
+                        unsigned int len, uint16_t crc)
+{
+    int n;
     uint8_t buf[1];
     int retry = 5;
-    uint16_t crc;
+    // a header of the sender, the receiver's signature frames are sent in XFER
+    int header = type == SOH && ctx->stat == MODEM_XFER_STAT_INIT;
+    #ifdef MODEM_XFER_FEC
+    uint8_t crc_buf[2] = { (crc >> 8) & 0xff, (crc >> 0) & 0xff };
+    uint8_t parity[YMODEM_FEC_MAX_PARITY];
+
+    if (type == FSOH) {
+        modem_xfer_fec_encode(payload, len, crc_buf, parity, ctx->fec_active);
+    }
+    #endif
 
     while (0 < retry--) {
-        dbg("%02X: %s: SOH %d bytes\n",  ctx->seqno, __func__, MODEM_XFER_BUF_SIZE);
-        modem_xfer_tx(SOH);
+        if (__ymodem_canceled(ctx)) {
+            return MODEM_XFER_RES_CANCELED;
+        }
+        dbg("%02X: %s: %02X %d bytes\n",  ctx->seqno, __func__, type, len);
+        modem_xfer_tx(type);
         modem_xfer_tx(ctx->seqno);
         //modem_xfer_tx((~ctx->seqno) + 1);
         modem_xfer_tx((~ctx->seqno));
-        for (unsigned int i = 0; i < MODEM_XFER_BUF_SIZE; i++) {
-            modem_xfer_tx(ctx->buf[i]);
+        for (unsigned int i = 0; i < len; i++) {
+            modem_xfer_tx(payload[i]);
         }
-        crc = modem_xfer_crc16(0, ctx->buf, MODEM_XFER_BUF_SIZE);
         modem_xfer_tx((crc >> 8) & 0xff);
         modem_xfer_tx((crc >> 0) & 0xff);
-        n = modem_xfer_recv_bytes(&buf[0], 1, 5000);
+        #ifdef MODEM_XFER_FEC
+        for (unsigned int i = 0; type == FSOH && i < ctx->fec_active; i++) {
+            modem_xfer_tx(parity[i]);
+        }
+        #endif
+        n = __ymodem_recv_answer(ctx, &buf[0], header);
         if (n != 1) {
             continue;
         }
@@ -227,6 +515,11 @@ static int __ymodem_send_block(ymodem_context *ctx)
             dbg("%02X: %s: received CAN\n",  ctx->seqno, __func__);
             return MODEM_XFER_RES_CANCELED;
         }
+        if (header && __ymodem_header_taken(ctx, buf[0])) {
+            dbg("%02X: %s: received 0x%02x, the ACK was lost\n",  ctx->seqno, __func__, buf[0]);
+            ctx->seqno++;
+            return YMODEM_RES_ANSWERED(buf[0]);
+        }
         if (buf[0] == NAK) {
             dbg("%02X: %s: received NAK\n",  ctx->seqno, __func__);
         } else {
@@ -238,11 +531,30 @@ static int __ymodem_send_block(ymodem_context *ctx)
     return MODEM_XFER_RES_TIMEOUT;
 }
 
+#ifndef MODEM_XFER_NO_SEND
+static int __ymodem_send_block(ymodem_context *ctx)
+{
+    return __ymodem_send_frame(ctx, YMODEM_DATA_FRAME(ctx), ctx->buf, MODEM_XFER_BUF_SIZE,
+                               modem_xfer_crc16(0, ctx->buf, MODEM_XFER_BUF_SIZE));
+}
+
+static void __ymodem_send_digest(ymodem_context *ctx, const uint8_t *payload)
+{
+    unsigned int n = MODEM_XFER_BUF_SIZE;
+
+    if (ctx->file_size != 0 && ctx->file_size < ctx->file_offset + n) {
+        n = ctx->file_offset < ctx->file_size ? ctx->file_size - ctx->file_offset : 0;
+    }
+    modem_xfer_digest_update(ctx, payload, n);
+    ctx->file_offset += MODEM_XFER_BUF_SIZE;
+}
+
 int ymodem_send_block(ymodem_context *ctx)
 {
     int res = __ymodem_send_block(ctx);
     if (res == MODEM_XFER_RES_OK) {
         ctx->num_bytes_xfered += MODEM_XFER_BUF_SIZE;
+        __ymodem_send_digest(ctx, ctx->buf);
     }
     return res;
 }
@@ -262,3 +574,151 @@ int ymodem_send_end(ymodem_context *ctx)
 
     return res;
 }
+
+/*
+ * Frame cache
+ *
+ * Every frame of a file is encoded once into caller-provided memory, laid out
+ * as YMODEM_FRAME_CACHE_SLOT bytes per block (payload followed by the CRC in
+ * wire order). Slot 0 holds the header block, slot n holds data block n. The
+ * sequence number of block n is always (n & 0xff), so any number of sessions
+ * can stream the same cache without re-reading the file or recomputing CRCs.
+ */
+int ymodem_frame_cache_init(ymodem_frame_cache *cache, uint8_t *mem, uint32_t mem_size,
+                            char *file_name, uint32_t size)
+{
+    uint16_t crc;
+
+    if (mem_size < YMODEM_FRAME_CACHE_SLOT) {
+        return MODEM_XFER_RES_ENOMEM;
+    }
+    cache->mem = mem;
+    cache->max_frames = mem_size / YMODEM_FRAME_CACHE_SLOT;
+    cache->num_frames = 1;
+    cache->file_size = size;
+    cache->num_bytes = 0;
+    cache->refcount = 1;
+    cache->file_crc32 = 0;
+    cache->finished = 0;
+
+    __ymodem_encode_header(mem, file_name, size, NULL);
+    crc = modem_xfer_crc16(0, mem, MODEM_XFER_BUF_SIZE);
+    mem[MODEM_XFER_BUF_SIZE + 0] = (crc >> 8) & 0xff;
+    mem[MODEM_XFER_BUF_SIZE + 1] = (crc >> 0) & 0xff;
+
+    return MODEM_XFER_RES_OK;
+}
+
+static void __ymodem_frame_cache_seal(ymodem_frame_cache *cache, uint8_t *slot)
+{
+    uint16_t crc = modem_xfer_crc16(0, slot, MODEM_XFER_BUF_SIZE);
+    slot[MODEM_XFER_BUF_SIZE + 0] = (crc >> 8) & 0xff;
+    slot[MODEM_XFER_BUF_SIZE + 1] = (crc >> 0) & 0xff;
+    cache->num_frames++;
+}
+
+int ymodem_frame_cache_append(ymodem_frame_cache *cache, const uint8_t *data, unsigned int n)
+{
+    while (0 < n) {
+        unsigned int pos = cache->num_bytes % MODEM_XFER_BUF_SIZE;
+        unsigned int len = MODEM_XFER_BUF_SIZE - pos;
+        uint8_t *slot;
+
+        if (cache->finished) {
+            return MODEM_XFER_RES_ESEQUENCE;
+        }
+        if (cache->max_frames <= cache->num_frames) {
+            return MODEM_XFER_RES_ENOMEM;
+        }
+        slot = &cache->mem[cache->num_frames * YMODEM_FRAME_CACHE_SLOT];
+        if (n < len) {
+            len = n;
+        }
+        memcpy(&slot[pos], data, len);
+        cache->file_crc32 = modem_xfer_crc32(cache->file_crc32, data, len);
+        data += len;
+        n -= len;
+        cache->num_bytes += len;
+        if (pos + len == MODEM_XFER_BUF_SIZE) {
+            __ymodem_frame_cache_seal(cache, slot);
+        }
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+int ymodem_frame_cache_finish(ymodem_frame_cache *cache)
+{
+    unsigned int pos = cache->num_bytes % MODEM_XFER_BUF_SIZE;
+    uint8_t *slot;
+
+    // the last block is sealed already, sealing it again would write past it
+    if (cache->finished) {
+        return cache->file_size == MODEM_XFER_UNKNOWN_FILE_SIZE ||
+               cache->file_size == cache->num_bytes ? MODEM_XFER_RES_OK : MODEM_XFER_RES_EIO;
+    }
+    cache->finished = 1;
+    if (pos != 0) {
+        // pad the last block with ^Z as sz does
+        slot = &cache->mem[cache->num_frames * YMODEM_FRAME_CACHE_SLOT];
+        memset(&slot[pos], 0x1a, MODEM_XFER_BUF_SIZE - pos);
+        __ymodem_frame_cache_seal(cache, slot);
+    }
+    if (cache->file_size != MODEM_XFER_UNKNOWN_FILE_SIZE && cache->file_size != cache->num_bytes) {
+        return MODEM_XFER_RES_EIO;
+    }
+    if (cache->file_size != MODEM_XFER_UNKNOWN_FILE_SIZE) {
+        // the whole image is known now, so advertise its digest in the header
+        char ext[16];
+        char file_name[MODEM_XFER_BUF_SIZE];
+        uint16_t crc;
+
+        memcpy(ext, "crc32=", 6);
+        modem_xfer_utox(&ext[6], cache->file_crc32, 8);
+        memcpy(file_name, cache->mem, sizeof(file_name));
+        __ymodem_encode_header(cache->mem, file_name, cache->file_size, ext);
+        crc = modem_xfer_crc16(0, cache->mem, MODEM_XFER_BUF_SIZE);
+        cache->mem[MODEM_XFER_BUF_SIZE + 0] = (crc >> 8) & 0xff;
+        cache->mem[MODEM_XFER_BUF_SIZE + 1] = (crc >> 0) & 0xff;
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+void ymodem_frame_cache_get(ymodem_frame_cache *cache)
+{
+    __atomic_add_fetch(&cache->refcount, 1, __ATOMIC_RELAXED);
+}
+
+int ymodem_frame_cache_put(ymodem_frame_cache *cache)
+{
+    return __atomic_sub_fetch(&cache->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+int ymodem_send_cached_file(ymodem_context *ctx, ymodem_frame_cache *cache)
+{
+    int res;
+    uint32_t i;
+    const uint8_t *slot = cache->mem;
+
+    // without ymodem_frame_cache_finish() the last block and the crc32 are missing
+    if (!cache->finished) {
+        return MODEM_XFER_RES_ESEQUENCE;
+    }
+    // the header was encoded without ctx, so it carries no caps token
+    ctx->flags &= ~YMODEM_FLAG_CAPS;
+    res = __ymodem_send_header(ctx, slot, slot[MODEM_XFER_BUF_SIZE] * 256 +
+                               slot[MODEM_XFER_BUF_SIZE + 1], (char *)slot, cache->file_size);
+    for (i = 1; res == MODEM_XFER_RES_OK && i < cache->num_frames; i++) {
+        slot = &cache->mem[i * YMODEM_FRAME_CACHE_SLOT];
+        res = __ymodem_send_frame(ctx, SOH, slot, MODEM_XFER_BUF_SIZE,
+                                  slot[MODEM_XFER_BUF_SIZE] * 256 + slot[MODEM_XFER_BUF_SIZE + 1]);
+        if (res == MODEM_XFER_RES_OK) {
+            ctx->num_bytes_xfered += MODEM_XFER_BUF_SIZE;
+            __ymodem_send_digest(ctx, slot);
+        }
+    }
+
+    return res;
+}
+#endif  // MODEM_XFER_NO_SEND
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Several sessions stream one frame cache at the same time: every sender
+ * takes a reference with ymodem_frame_cache_get() and drops it when its
+ * session ends, and each receiver must end up with the original file.
+ */
+
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NUM_SESSIONS 4
+#define FILE_SIZE 5000
+#define GUARD_SIZE (2 * YMODEM_FRAME_CACHE_SLOT)
+#define PIPE_SIZE 4096
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t head;
+    uint32_t tail;
+    uint8_t data[PIPE_SIZE];
+} cache_pipe;
+
+typedef struct {
+    cache_pipe pipes[2];
+    uint8_t file[FILE_SIZE + MODEM_XFER_BUF_SIZE];
+    uint32_t file_size;
+    int send_res;
+    int recv_res;
+} cache_session;
+
+static __thread cache_pipe *tx_pipe, *rx_pipe;
+static __thread cache_session *self;
+static cache_session sessions[NUM_SESSIONS];
+static ymodem_frame_cache cache;
+static uint8_t mem[YMODEM_FRAME_CACHE_SIZE(FILE_SIZE) + GUARD_SIZE];
+static uint8_t data[FILE_SIZE];
+static int num_freed;
+
+uint32_t modem_xfer_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+int modem_xfer_tx(uint8_t c)
+{
+    cache_pipe *p = tx_pipe;
+
+    if (p == NULL) {
+        // only the main thread has no session, and it must not send anything
+        printf("an unfinished cache was sent\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&p->lock);
+    if (p->head - p->tail < PIPE_SIZE) {
+        p->data[p->head++ % PIPE_SIZE] = c;
+        pthread_cond_signal(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return 1;
+}
+
+int modem_xfer_rx(uint8_t *c, int timeout_ms)
+{
+    cache_pipe *p = rx_pipe;
+    struct timespec ts;
+    int res = 0;
+
+    if (p == NULL) {
+        return 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (1000000000L <= ts.tv_nsec) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&p->lock);
+    while (p->head == p->tail && 0 < timeout_ms) {
+        if (pthread_cond_timedwait(&p->cond, &p->lock, &ts) != 0) {
+            break;
+        }
+    }
+    if (p->head != p->tail) {
+        *c = p->data[p->tail++ % PIPE_SIZE];
+        res = 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return res;
+}
+
+int modem_xfer_save(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    if (sizeof(self->file) < offset + size) {
+        return MODEM_XFER_RES_EIO;
+    }
+    if (buf == NULL && size == 0) {
+        self->file_size = offset;
+        return 0;
+    }
+    memcpy(&self->file[offset], buf, size);
+    if (self->file_size < offset + size) {
+        self->file_size = offset + size;
+    }
+
+    return 0;
+}
+
+int modem_xfer_load(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    return 0;
+}
+
+void modem_xfer_printf(int log_level, const char *format, ...)
+{
+}
+
+static void *sender(void *arg)
+{
+    cache_session *s = arg;
+    ymodem_context ctx;
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+
+    self = s;
+    tx_pipe = &s->pipes[0];
+    rx_pipe = &s->pipes[1];
+    ymodem_send_init(&ctx, buf);
+    s->send_res = ymodem_send_cached_file(&ctx, &cache);
+    if (s->send_res == MODEM_XFER_RES_OK) {
+        s->send_res = ymodem_send_end(&ctx);
+    }
+    if (ymodem_frame_cache_put(&cache) == 0) {
+        __atomic_add_fetch(&num_freed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static void *receiver(void *arg)
+{
+    cache_session *s = arg;
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+
+    self = s;
+    tx_pipe = &s->pipes[1];
+    rx_pipe = &s->pipes[0];
+    s->recv_res = ymodem_receive(buf);
+
+    return NULL;
+}
+
+int main(int ac, char *av[])
+{
+    static uint8_t unfinished_mem[YMODEM_FRAME_CACHE_SIZE(FILE_SIZE)];
+    pthread_t threads[2 * NUM_SESSIONS];
+    ymodem_frame_cache unfinished;
+    ymodem_context ctx;
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+    uint32_t num_frames;
+    int errors = 0;
+    int i, j;
+
+    srand(1);
+    for (i = 0; i < FILE_SIZE; i++) {
+        data[i] = (uint8_t)rand();
+    }
+    memset(mem, 0xa5, sizeof(mem));
+    if (ymodem_frame_cache_init(&cache, mem, YMODEM_FRAME_CACHE_SIZE(FILE_SIZE), "cache.dat",
+                                FILE_SIZE) != MODEM_XFER_RES_OK ||
+        ymodem_frame_cache_append(&cache, data, FILE_SIZE) != MODEM_XFER_RES_OK ||
+        ymodem_frame_cache_finish(&cache) != MODEM_XFER_RES_OK) {
+        printf("cache init failed\n");
+        return 1;
+    }
+
+    // finishing again must neither reseal the last block nor write past the cache
+    num_frames = cache.num_frames;
+    if (ymodem_frame_cache_finish(&cache) != MODEM_XFER_RES_OK || cache.num_frames != num_frames ||
+        ymodem_frame_cache_append(&cache, data, 1) != MODEM_XFER_RES_ESEQUENCE) {
+        printf("second finish changed the cache\n");
+        errors++;
+    }
+    // nor may an unfinished cache go out, short of its last block and crc32
+    if (ymodem_frame_cache_init(&unfinished, unfinished_mem, sizeof(unfinished_mem), "part.dat",
+                                FILE_SIZE) != MODEM_XFER_RES_OK ||
+        ymodem_frame_cache_append(&unfinished, data, MODEM_XFER_BUF_SIZE + 1) !=
+        MODEM_XFER_RES_OK) {
+        printf("cache init failed\n");
+        return 1;
+    }
+    ymodem_send_init(&ctx, buf);
+    if (ymodem_send_cached_file(&ctx, &unfinished) != MODEM_XFER_RES_ESEQUENCE) {
+        printf("an unfinished cache was sent\n");
+        errors++;
+    }
+    for (i = YMODEM_FRAME_CACHE_SIZE(FILE_SIZE); i < (int)sizeof(mem); i++) {
+        if (mem[i] != 0xa5) {
+            printf("guard byte %d overwritten\n", i);
+            errors++;
+            break;
+        }
+    }
+
+    for (i = 0; i < NUM_SESSIONS; i++) {
+        for (j = 0; j < 2; j++) {
+            pthread_mutex_init(&sessions[i].pipes[j].lock, NULL);
+            pthread_cond_init(&sessions[i].pipes[j].cond, NULL);
+        }
+        ymodem_frame_cache_get(&cache);
+        pthread_create(&threads[2 * i + 0], NULL, receiver, &sessions[i]);
+        pthread_create(&threads[2 * i + 1], NULL, sender, &sessions[i]);
+    }
+    // the owner lets go while the sessions still stream it
+    if (ymodem_frame_cache_put(&cache) == 0) {
+        __atomic_add_fetch(&num_freed, 1, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < 2 * NUM_SESSIONS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < NUM_SESSIONS; i++) {
+        cache_session *s = &sessions[i];
+
+        if (s->send_res != MODEM_XFER_RES_OK || s->recv_res != MODEM_XFER_RES_OK ||
+            s->file_size != FILE_SIZE || memcmp(s->file, data, FILE_SIZE) != 0) {
+            printf("session %d: send %d, receive %d, %u bytes\n",
+                   i, s->send_res, s->recv_res, s->file_size);
+            errors++;
+        }
+    }
+    if (num_freed != 1) {
+        printf("the last reference was dropped %d times\n", num_freed);
+        errors++;
+    }
+    printf("%d sessions x %d bytes from one cache of %u frames, %d errors\n",
+           NUM_SESSIONS, FILE_SIZE, cache.num_frames, errors);
+    if (errors != 0) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Known answers of the digests, and the same answers whichever way the data
+ * is split across update calls or aligned in memory. Build once per CRC-32
+ * variant: the 256 entry table, MODEM_XFER_CRC32_SMALL and, on ARM with the
+ * CRC extension, the __crc32 instructions.
+ */
+
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#define CRC32_VARIANT "arm crc32"
+#elif defined(MODEM_XFER_CRC32_SMALL)
+#define CRC32_VARIANT "16 entry table"
+#else
+#define CRC32_VARIANT "256 entry table"
+#endif
+
+static int errors;
+
+static void check_crc32(const char *what, uint32_t got, uint32_t expected)
+{
+    if (got != expected) {
+        printf("crc32 %s: %08lx != %08lx\n", what, (unsigned long)got, (unsigned long)expected);
+        errors++;
+    }
+}
+
+// bit at a time, the definition the table and instruction variants must agree with
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t *p, unsigned int n)
+{
+    int i;
+
+    crc = ~crc;
+    while (n--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+static void test_crc32(void)
+{
+    static uint8_t buf[300 + 4];
+    const char *s = "123456789";
+    uint32_t crc;
+    unsigned int i, n, align;
+
+    check_crc32("of nothing", modem_xfer_crc32(0, "", 0), 0);
+    check_crc32("of 123456789", modem_xfer_crc32(0, s, 9), 0xcbf43926);
+    for (i = 0; i <= 9; i++) {
+        crc = modem_xfer_crc32(modem_xfer_crc32(0, s, i), s + i, 9 - i);
+        check_crc32("of 123456789 in two", crc, 0xcbf43926);
+    }
+
+    // every length and alignment around the word loop of the instruction variant
+    srand(1);
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)rand();
+    }
+    for (align = 0; align < 4; align++) {
+        for (n = 0; n <= 300; n++) {
+            check_crc32("of random data", modem_xfer_crc32(0, &buf[align], n),
+                        crc32_bitwise(0, &buf[align], n));
+        }
+    }
+}
+
+#ifdef MODEM_XFER_SHA256
+static void check_sha256(const char *what, modem_xfer_sha256 *sha, const char *expected)
+{
+    uint8_t digest[32];
+    char hex[65];
+    int i;
+
+    modem_xfer_sha256_final(sha, digest);
+    for (i = 0; i < 32; i++) {
+        snprintf(&hex[2 * i], 3, "%02x", digest[i]);
+    }
+    if (strcmp(hex, expected) != 0) {
+        printf("sha256 %s:\n  %s !=\n  %s\n", what, hex, expected);
+        errors++;
+    }
+}
+
+static void sha256_of(const char *what, const char *s, const char *expected)
+{
+    modem_xfer_sha256 sha;
+    unsigned int i, n = strlen(s);
+
+    modem_xfer_sha256_init(&sha);
+    modem_xfer_sha256_update(&sha, s, n);
+    check_sha256(what, &sha, expected);
+    for (i = 0; i <= n; i++) {
+        modem_xfer_sha256_init(&sha);
+        modem_xfer_sha256_update(&sha, s, i);
+        modem_xfer_sha256_update(&sha, s + i, n - i);
+        check_sha256(what, &sha, expected);
+    }
+}
+
+static void test_sha256(void)
+{
+    static char a[997];
+    modem_xfer_sha256 sha;
+    unsigned int n;
+
+    // FIPS 180-2 examples
+    sha256_of("of nothing", "",
+              "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    sha256_of("of abc", "abc",
+              "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    sha256_of("of two blocks", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+              "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    sha256_of("of 896 bits",
+              "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+              "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+              "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+
+    memset(a, 'a', sizeof(a));
+    modem_xfer_sha256_init(&sha);
+    for (n = 0; n < 1000000; n += sizeof(a)) {
+        modem_xfer_sha256_update(&sha, a, 1000000 - n < sizeof(a) ? 1000000 - n : sizeof(a));
+    }
+    check_sha256("of a million a", &sha,
+                 "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+#endif  // MODEM_XFER_SHA256
+
+int main(int ac, char *av[])
+{
+    test_crc32();
+    #ifdef MODEM_XFER_SHA256
+    test_sha256();
+    #endif
+    printf("crc32 (%s)%s: %d errors\n", CRC32_VARIANT,
+           #ifdef MODEM_XFER_SHA256
+           " and sha256",
+           #else
+           "",
+           #endif
+           errors);
+    if (errors != 0) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
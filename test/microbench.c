@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the code which runs per byte or per frame
+ *
+ * The ports are memory-backed: modem_xfer_tx() goes nowhere and modem_xfer_rx()
+ * plays back a prepared byte stream, so nothing but the library is measured.
+ * Each kernel is calibrated to run for at least --min-ms, repeated --repeat
+ * times on a pinned CPU, and reported by its best and median run. The table
+ * goes to stderr, the JSON to stdout (or --json FILE) for comparing commits.
+ */
+
+#define _GNU_SOURCE
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+
+#define FRAME_SIZE (3 + MODEM_XFER_BUF_SIZE + 2)
+#define MAX_FRAMES 256  // per session of the receive kernel
+#define MAX_RESULTS 64
+#define ACK 0x06
+#define EOT 0x04
+
+typedef struct {
+    const char *kernel;
+    unsigned int size;  // bytes per operation
+    void (*fn)(long n, unsigned int size);
+} bench_case;
+
+typedef struct {
+    const char *kernel;
+    unsigned int size;
+    double best_ns, median_ns;  // per operation
+} bench_result;
+
+static const uint8_t *rx_ptr, *rx_end;
+static int rx_default = -1;  // what modem_xfer_rx() returns once the stream is over
+static volatile uint32_t tx_sink;
+static char log_buf[256];
+static uint8_t data[4096];
+static uint8_t frames[FRAME_SIZE * (MAX_FRAMES + 1)];  // block 0 and MAX_FRAMES blocks
+static uint8_t header[FRAME_SIZE + 2];  // block 0 and EOT EOT
+static int repeat = 5, min_ms = 100;
+static bench_result results[MAX_RESULTS];
+static int num_results;
+
+int modem_xfer_tx(uint8_t c)
+{
+    tx_sink += c;
+    return 1;
+}
+
+int modem_xfer_rx(uint8_t *c, int timeout_ms)
+{
+    // the peer answers what it has seen, so nothing is ever queued ahead of a poll
+    if (timeout_ms == 0) {
+        return 0;
+    }
+    if (rx_ptr < rx_end) {
+        *c = *rx_ptr++;
+        return 1;
+    }
+    if (0 <= rx_default) {
+        *c = (uint8_t)rx_default;
+        return 1;
+    }
+    return 0;
+}
+
+int modem_xfer_save(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    return 0;
+}
+
+int modem_xfer_load(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    return 0;
+}
+
+void modem_xfer_printf(int log_level, const char *format, ...)
+{
+    va_list ap;
+
+    // format the message as a real port would, but print nothing
+    va_start (ap, format);
+    vsnprintf(log_buf, sizeof(log_buf), format, ap);
+    va_end (ap);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint32_t modem_xfer_clock_ms(void)
+{
+    return (uint32_t)(now_ns() / 1000000);
+}
+
+// a kernel which fails measures nothing but its error path
+static void check(int res, const char *what)
+{
+    if (res != MODEM_XFER_RES_OK) {
+        fprintf(stderr, "%s failed, %d\n", what, res);
+        exit(1);
+    }
+}
+
+static void rx_play(const uint8_t *buf, unsigned int n, int dflt)
+{
+    rx_ptr = buf;
+    rx_end = buf + n;
+    rx_default = dflt;
+}
+
+static unsigned int put_frame(uint8_t *p, uint8_t seqno, const uint8_t *payload)
+{
+    uint16_t crc = modem_xfer_crc16(0, payload, MODEM_XFER_BUF_SIZE);
+
+    p[0] = 0x01;
+    p[1] = seqno;
+    p[2] = ~seqno;
+    memcpy(&p[3], payload, MODEM_XFER_BUF_SIZE);
+    p[3 + MODEM_XFER_BUF_SIZE] = crc >> 8;
+    p[4 + MODEM_XFER_BUF_SIZE] = crc & 0xff;
+
+    return FRAME_SIZE;
+}
+
+// block 0 as a sender of this library writes it, size 0 for an endless file
+static unsigned int put_header(uint8_t *p, uint32_t size)
+{
+    uint8_t payload[MODEM_XFER_BUF_SIZE];
+    int n;
+
+    memset(payload, 0, sizeof(payload));
+    n = snprintf((char *)payload, sizeof(payload), "bench.bin%c%lu 0 0", 0, (unsigned long)size);
+    snprintf((char *)&payload[n + 1], sizeof(payload) - n - 1, "crc32=00000000 caps=01");
+
+    return put_frame(p, 0, payload);
+}
+
+static void k_crc16(long n, unsigned int size)
+{
+    uint16_t crc = 0;
+
+    while (0 < n--) {
+        crc = modem_xfer_crc16(crc, data, size);
+    }
+    tx_sink += crc;
+}
+
+static void k_recv_bytes(long n, unsigned int size)
+{
+    uint8_t buf[sizeof(data)];
+
+    while (0 < n--) {
+        rx_play(data, size, -1);
+        modem_xfer_recv_bytes(buf, size, 1000);
+    }
+}
+
+static void send_session(ymodem_context *ctx, uint8_t *buf, int fec)
+{
+    // 'C' for the header, its ACK, FREQ if FEC is on and the start byte
+    static const uint8_t script[] = { 'C', ACK, 'C' }, script_fec[] = { 'C', ACK, 'F', 'C' };
+
+    ymodem_send_init(ctx, buf);
+    #ifdef MODEM_XFER_FEC
+    ymodem_set_fec(ctx, fec);
+    #endif
+    if (fec) {
+        rx_play(script_fec, sizeof(script_fec), ACK);
+    } else {
+        rx_play(script, sizeof(script), ACK);
+    }
+    check(ymodem_send_header(ctx, "bench.bin", MODEM_XFER_UNKNOWN_FILE_SIZE), "send_header");
+}
+
+static void k_send_block(long n, unsigned int size)
+{
+    ymodem_context ctx;
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+
+    send_session(&ctx, buf, 0);
+    while (0 < n--) {
+        check(ymodem_send_block(&ctx), "send_block");
+    }
+}
+
+#ifdef MODEM_XFER_FEC
+static void k_send_block_fec(long n, unsigned int size)
+{
+    ymodem_context ctx;
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+
+    send_session(&ctx, buf, YMODEM_FEC_PARITY);
+    while (0 < n--) {
+        check(ymodem_send_block(&ctx), "send_block");
+    }
+}
+#endif
+
+static void k_receive_block(long n, unsigned int size)
+{
+    ymodem_context ctx;
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+    unsigned int len, i, num;
+
+    // a session per MAX_FRAMES, so the header is part of the cost of a frame
+    while (0 < n) {
+        num = MAX_FRAMES < n ? MAX_FRAMES : n;
+        ymodem_receive_init(&ctx, buf);
+        rx_play(frames, FRAME_SIZE * (num + 1), -1);
+        for (i = 0; i < num; i++) {
+            check(ymodem_receive_block(&ctx, &len), "receive_block");
+        }
+        n -= num;
+    }
+}
+
+static void k_receive_header(long n, unsigned int size)
+{
+    ymodem_context ctx;
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+    unsigned int len;
+
+    // block 0 and an empty file: header parsing and the EOT handshake
+    while (0 < n--) {
+        ymodem_receive_init(&ctx, buf);
+        ctx.flags |= YMODEM_FLAG_EOF_BLOCK;
+        rx_play(header, sizeof(header), -1);
+        check(ymodem_receive_block(&ctx, &len), "receive_header");
+    }
+}
+
+static void k_hex_dump(long n, unsigned int size)
+{
+    while (0 < n--) {
+        modem_xfer_hex_dump(MODEM_XFER_LOG_VERBOSE, data, size);
+    }
+}
+
+static void k_hex_dump_off(long n, unsigned int size)
+{
+    // below the level at which dumps are printed, the common case
+    while (0 < n--) {
+        modem_xfer_hex_dump(MODEM_XFER_LOG_DEBUG, data, size);
+    }
+}
+
+static const bench_case cases[] = {
+    { "crc16", 16, k_crc16 },
+    { "crc16", 128, k_crc16 },
+    { "crc16", 1024, k_crc16 },
+    { "crc16", 4096, k_crc16 },
+    { "recv_bytes", 1, k_recv_bytes },
+    { "recv_bytes", 16, k_recv_bytes },
+    { "recv_bytes", 128, k_recv_bytes },
+    { "recv_bytes", 1024, k_recv_bytes },
+    { "send_block", MODEM_XFER_BUF_SIZE, k_send_block },
+    #ifdef MODEM_XFER_FEC
+    { "send_block_fec", MODEM_XFER_BUF_SIZE, k_send_block_fec },
+    #endif
+    { "receive_block", MODEM_XFER_BUF_SIZE, k_receive_block },
+    { "receive_header", MODEM_XFER_BUF_SIZE, k_receive_header },
+    { "hex_dump", 16, k_hex_dump },
+    { "hex_dump", 128, k_hex_dump },
+    { "hex_dump_off", 128, k_hex_dump_off },
+};
+
+static uint64_t time_ns(const bench_case *c, long n)
+{
+    uint64_t start = now_ns();
+
+    c->fn(n, c->size);
+    return now_ns() - start;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : y < x;
+}
+
+static void run_case(const bench_case *c)
+{
+    bench_result *r = &results[num_results++];
+    double ns[64];
+    uint64_t t;
+    long n = 1;
+    int i;
+
+    // double the count until a run is long enough to scale from, then scale it to min_ms
+    while ((t = time_ns(c, n)) < (uint64_t)min_ms * 100000 && n < (1L << 40)) {
+        n *= 2;
+    }
+    n = (long)((double)n * min_ms * 1000000 / (t ? t : 1)) + 1;
+    for (i = 0; i < repeat; i++) {
+        ns[i] = (double)time_ns(c, n) / n;
+    }
+    qsort(ns, repeat, sizeof(ns[0]), cmp_double);
+    r->kernel = c->kernel;
+    r->size = c->size;
+    r->best_ns = ns[0];
+    r->median_ns = ns[repeat / 2];
+    fprintf(stderr, "%-16s %5u bytes %12.1f ns/op %8.3f ns/byte %12.0f ops/s\n", r->kernel,
+            r->size, r->best_ns, r->best_ns / r->size, 1e9 / r->best_ns);
+}
+
+static void print_json(FILE *fp, const char *label, int cpu)
+{
+    int i;
+
+    fprintf(fp, "{\n  \"label\": \"%s\",\n  \"cpu\": %d,\n  \"repeat\": %d,\n  \"min_ms\": %d,\n"
+            "  \"results\": [\n", label, cpu, repeat, min_ms);
+    for (i = 0; i < num_results; i++) {
+        bench_result *r = &results[i];
+        fprintf(fp, "    { \"kernel\": \"%s\", \"size\": %u, \"ns_per_op\": %.2f, "
+                "\"ns_per_op_median\": %.2f, \"ns_per_byte\": %.4f, \"ops_per_sec\": %.0f }%s\n",
+                r->kernel, r->size, r->best_ns, r->median_ns, r->best_ns / r->size,
+                1e9 / r->best_ns, i + 1 < num_results ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int ac, char *av[])
+{
+    const char *label = "", *json = NULL, *filter = NULL;
+    int cpu = 0, i;
+    cpu_set_t set;
+    FILE *fp = stdout;
+
+    for (i = 1; i < ac; i++) {
+        if (strcmp(av[i], "--repeat") == 0 && i + 1 < ac) {
+            repeat = atoi(av[++i]);
+        } else
+        if (strcmp(av[i], "--min-ms") == 0 && i + 1 < ac) {
+            min_ms = atoi(av[++i]);
+        } else
+        if (strcmp(av[i], "--cpu") == 0 && i + 1 < ac) {
+            cpu = atoi(av[++i]);
+        } else
+        if (strcmp(av[i], "--label") == 0 && i + 1 < ac) {
+            label = av[++i];
+        } else
+        if (strcmp(av[i], "--json") == 0 && i + 1 < ac) {
+            json = av[++i];
+        } else
+        if (strcmp(av[i], "--filter") == 0 && i + 1 < ac) {
+            filter = av[++i];
+        } else {
+            fprintf(stderr, "usage: microbench [--repeat N] [--min-ms MS] [--cpu N (-1 for any)]\n"
+                    "                  [--label TEXT] [--json FILE] [--filter KERNEL]\n");
+            return 2;
+        }
+    }
+    if (repeat < 1 || 64 < repeat || min_ms < 1) {
+        fprintf(stderr, "--repeat must be 1 to 64 and --min-ms positive\n");
+        return 2;
+    }
+    if (0 <= cpu) {
+        // one CPU, so that migrations and frequency domains don't add noise
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            fprintf(stderr, "can't pin to CPU %d, running unpinned\n", cpu);
+            cpu = -1;
+        }
+    }
+    for (i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    put_header(frames, 0);
+    for (i = 1; i <= MAX_FRAMES; i++) {
+        put_frame(&frames[FRAME_SIZE * i], (uint8_t)i, data);
+    }
+    put_header(header, 0);
+    header[FRAME_SIZE] = EOT;
+    header[FRAME_SIZE + 1] = EOT;
+
+    for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+        if (filter == NULL || strcmp(filter, cases[i].kernel) == 0) {
+            run_case(&cases[i]);
+        }
+    }
+    if (json != NULL && (fp = fopen(json, "w")) == NULL) {
+        fprintf(stderr, "can't open %s\n", json);
+        return 1;
+    }
+    print_json(fp, label, cpu);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    return 0;
+}
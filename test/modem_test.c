@@ -37,12 +37,29 @@
 #include <sys/select.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 
 static int tx_fd = -1;
 static int rx_fd = -1;
 uint32_t prev_random = 654321;
 uint32_t tx_error_rate;
 uint32_t rx_error_rate;
+static int use_frame_cache = 0;
+static int use_delta = 0;
+static char *pack_name = NULL;
+static int capture_fd = -1;
+static int replay_fd = -1;
+static int replay_fast = 0;
+static char *trace_name = NULL;
+static int cancel_after_ms = -1;
+static int error_rate = -1;
+static int fec_parity = 0;
+static int peer = 0;
+static volatile uint32_t cancel_at_ms;
+static uint32_t replay_start_ms;
+static modem_xfer_capture capture;
+static modem_xfer_replay replay;
 
 static void own_srand(uint32_t seed) {
     prev_random = seed;
@@ -54,8 +71,9 @@ static uint32_t own_rand() {
 
 static int open_fifo(void)
 {
-    const char *TX = "/tmp/modem_test-tx";
-    const char *RX = "/tmp/modem_test-rx";
+    // a peer talks to another modem_test, so its ends of the fifos are swapped
+    const char *TX = peer ? "/tmp/modem_test-rx" : "/tmp/modem_test-tx";
+    const char *RX = peer ? "/tmp/modem_test-tx" : "/tmp/modem_test-rx";
 
     mkfifo(TX, 0660);
     tx_fd = open(TX, O_RDWR);
@@ -99,6 +117,50 @@ static int open_socket(int port)
     return (0 <= tx_fd) ? 0 : -1;
 }
 
+static int capture_write(void *arg, const uint8_t *buf, unsigned int n)
+{
+    return write(*(int *)arg, buf, n);
+}
+
+static int replay_read(void *arg, uint8_t *buf, unsigned int n)
+{
+    return read(*(int *)arg, buf, n);
+}
+
+static uint32_t wall_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void replay_sync(void)
+{
+    // sleep until the wall clock catches up with the virtual clock of the replay
+    uint32_t now = wall_clock_ms() - replay_start_ms;
+
+    if (now < replay.now) {
+        usleep((replay.now - now) * 1000);
+    }
+}
+
+static void *cancel_thread(void *arg)
+{
+    usleep(cancel_after_ms * 1000);
+    cancel_at_ms = wall_clock_ms();
+    ymodem_request_cancel((ymodem_context *)arg);
+
+    return NULL;
+}
+
+static void report_cancel_latency(void)
+{
+    if (cancel_at_ms != 0) {
+        printf("cancel latency %lu ms\n", (unsigned long)(wall_clock_ms() - cancel_at_ms));
+    }
+}
+
 static void close_port(void)
 {
     if (0 <= tx_fd)
@@ -111,11 +173,21 @@ int modem_xfer_tx(uint8_t c)
 {
     int res;
 
+    if (0 <= replay_fd) {
+        // the capture already contains the injected errors
+        modem_xfer_replay_tx(&replay, c);
+        return 1;
+    }
+
     if (tx_error_rate && (own_rand() % tx_error_rate) == 0) {
         printf(" ** %s: TX error injected\n", __func__);
         c = (uint8_t)own_rand();
     }
 
+    if (0 <= capture_fd) {
+        modem_xfer_capture_bytes(&capture, MODEM_XFER_CAPTURE_TX, &c, 1);
+    }
+
     res = write(tx_fd, &c, 1);
     if (res < 0) {
         return -errno;
@@ -129,6 +201,15 @@ int modem_xfer_rx(uint8_t *c, int timeout_ms)
     int res;
     fd_set set;
     struct timeval tv;
+
+    if (0 <= replay_fd) {
+        res = modem_xfer_replay_rx(&replay, c, timeout_ms);
+        if (!replay_fast) {
+            replay_sync();
+        }
+        return res;
+    }
+
     FD_ZERO(&set);
     FD_SET(rx_fd, &set);
     tv.tv_sec = timeout_ms / 1000;
@@ -153,6 +234,9 @@ int modem_xfer_rx(uint8_t *c, int timeout_ms)
         printf(" ** %s: RX error injected\n", __func__);
         *c = (uint8_t)own_rand();
     }
+    if (0 <= capture_fd) {
+        modem_xfer_capture_bytes(&capture, MODEM_XFER_CAPTURE_RX, c, 1);
+    }
 
     return 1;
 }
@@ -199,6 +283,20 @@ int modem_xfer_save(char *file_name, uint32_t offset, uint8_t *buf, uint16_t siz
     return res;
 }
 
+int modem_xfer_load(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    int res;
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    res = pread(fd, buf, size, offset);
+    close(fd);
+
+    return res < 0 ? -EIO : res;
+}
+
 void modem_xfer_printf(int log_level, const char *format, ...)
 {
     va_list ap;
@@ -207,6 +305,77 @@ void modem_xfer_printf(int log_level, const char *format, ...)
     va_end (ap);
 }
 
+static int send_cached_file(ymodem_context *ctx, int fd, char *file_name, uint32_t size)
+{
+    ymodem_frame_cache cache;
+    uint8_t *mem;
+    uint8_t tmp[512];
+    int n, res;
+
+    mem = malloc(YMODEM_FRAME_CACHE_SIZE(size));
+    if (mem == NULL) {
+        return MODEM_XFER_RES_ENOMEM;
+    }
+    res = ymodem_frame_cache_init(&cache, mem, YMODEM_FRAME_CACHE_SIZE(size), file_name, size);
+    while (res == MODEM_XFER_RES_OK && (n = read(fd, tmp, sizeof(tmp))) > 0) {
+        res = ymodem_frame_cache_append(&cache, tmp, n);
+    }
+    if (res == MODEM_XFER_RES_OK) {
+        res = ymodem_frame_cache_finish(&cache);
+    }
+    if (res == MODEM_XFER_RES_OK) {
+        res = ymodem_send_cached_file(ctx, &cache);
+    }
+    if (ymodem_frame_cache_put(&cache) == 0) {
+        free(mem);
+    }
+
+    return res;
+}
+
+uint32_t modem_xfer_clock_ms(void)
+{
+    if (0 <= replay_fd) {
+        return replay.now;
+    }
+    return wall_clock_ms();
+}
+
+static int send_pack(ymodem_context *ctx, char *files[], int num_files)
+{
+    struct stat statbuf;
+    uint32_t size = 1;
+    uint8_t tmp[512];
+    char *file_name;
+    int i, n, fd, res;
+
+    for (i = 0; i < num_files; i++) {
+        stat(files[i], &statbuf);
+        file_name = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+        size += ymodem_pack_entry_size(file_name, (uint32_t)statbuf.st_size);
+    }
+    res = ymodem_send_pack_begin(ctx, pack_name, size);
+    for (i = 0; res == MODEM_XFER_RES_OK && i < num_files; i++) {
+        stat(files[i], &statbuf);
+        file_name = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+        fd = open(files[i], O_RDONLY);
+        if (fd < 0) {
+            printf("can't open file %s\n", files[i]);
+            return MODEM_XFER_RES_EIO;
+        }
+        res = ymodem_send_pack_file(ctx, file_name, (uint32_t)statbuf.st_size);
+        while (res == MODEM_XFER_RES_OK && (n = read(fd, tmp, sizeof(tmp))) > 0) {
+            res = ymodem_send_pack_data(ctx, tmp, n);
+        }
+        close(fd);
+    }
+    if (res == MODEM_XFER_RES_OK) {
+        res = ymodem_send_pack_end(ctx);
+    }
+
+    return res;
+}
+
 int main(int ac, char *av[])
 {
     uint8_t buf[MODEM_XFER_BUF_SIZE];
@@ -216,6 +385,8 @@ int main(int ac, char *av[])
     int num_send_files = 0;
     struct stat statbuf;
     char *p;
+    int fd;
+    int res = 0;
 
     for (i = 1; i < ac; i++) {
         if (av[i][0] == '-') {
@@ -240,6 +411,86 @@ int main(int ac, char *av[])
                     exit(1);
                 }
                 i++;
+            } else
+            if (strcmp(av[i], "--frame-cache") == 0) {
+                use_frame_cache = 1;
+            } else
+            if (strcmp(av[i], "--delta") == 0) {
+                use_delta = 1;
+            } else
+            if (strcmp(av[i], "--pack") == 0) {
+                if (ac <= i + 1) {
+                    printf("--pack option requires a batch name argument\n");
+                    exit(1);
+                }
+                pack_name = av[++i];
+            } else
+            if (strcmp(av[i], "--capture") == 0 || strcmp(av[i], "--replay") == 0) {
+                if (ac <= i + 1) {
+                    printf("%s option requires a file name argument\n", av[i]);
+                    exit(1);
+                }
+                if (strcmp(av[i], "--capture") == 0) {
+                    capture_fd = open(av[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0664);
+                    fd = capture_fd;
+                } else {
+                    replay_fd = open(av[i + 1], O_RDONLY);
+                    fd = replay_fd;
+                }
+                if (fd < 0) {
+                    printf("can't open %s\n", av[i + 1]);
+                    exit(1);
+                }
+                i++;
+            } else
+            if (strcmp(av[i], "--trace") == 0) {
+                // save the trace for tools/mxtrace instead of dumping it
+                if (ac <= i + 1) {
+                    printf("--trace option requires a file name argument\n");
+                    exit(1);
+                }
+                trace_name = av[++i];
+            } else
+            if (strcmp(av[i], "--replay-fast") == 0) {
+                replay_fast = 1;
+            } else
+            if (strcmp(av[i], "--cancel-after") == 0) {
+                p = &av[i][0];
+                if (i + 1 < ac) {
+                    cancel_after_ms = strtol(av[i + 1], &p, 0);
+                }
+                if (*p != '\0' || cancel_after_ms < 0) {
+                    printf("--cancel-after option requires milliseconds argument\n");
+                    exit(1);
+                }
+                i++;
+            } else
+            if (strcmp(av[i], "--error-rate") == 0) {
+                // one byte in N is corrupted in each direction, 0 for a clean link
+                p = &av[i][0];
+                if (i + 1 < ac) {
+                    error_rate = strtol(av[i + 1], &p, 0);
+                }
+                if (*p != '\0' || error_rate < 0) {
+                    printf("--error-rate option requires a integer argument\n");
+                    exit(1);
+                }
+                i++;
+            } else
+            if (strcmp(av[i], "--fec") == 0) {
+                p = &av[i][0];
+                if (i + 1 < ac) {
+                    fec_parity = strtol(av[i + 1], &p, 0);
+                }
+                if (*p != '\0' || fec_parity < 0 || YMODEM_FEC_MAX_PARITY < fec_parity) {
+                    printf("--fec option requires the number of parity bytes, up to %d\n",
+                           YMODEM_FEC_MAX_PARITY);
+                    exit(1);
+                }
+                i++;
+            } else
+            if (strcmp(av[i], "--peer") == 0) {
+                peer = 1;
             } else {
                 printf("unknown option %s\n", av[i]);
                 exit(1);
@@ -261,6 +512,13 @@ int main(int ac, char *av[])
         }
     }
 
+    if (0 <= replay_fd) {
+        if (modem_xfer_replay_start(&replay, replay_read, &replay_fd) != MODEM_XFER_RES_OK) {
+            printf("invalid capture file\n");
+            exit(1);
+        }
+        replay_start_ms = wall_clock_ms();
+    } else
     if (0 <= port) {
         if (open_socket(port) != 0) {
             printf("open_socket() failed\n");
@@ -271,22 +529,45 @@ int main(int ac, char *av[])
         printf("open_fifo() failed\n");
         exit(1);
     }
+    if (0 <= capture_fd) {
+        modem_xfer_capture_start(&capture, capture_write, &capture_fd);
+    }
 
     if (num_send_files == 0) {
-        tx_error_rate = 100;
-        rx_error_rate = 500;
-        if (ymodem_receive(buf) != 0) {
+        tx_error_rate = 0 <= error_rate ? error_rate : 100;
+        rx_error_rate = 0 <= error_rate ? error_rate : 500;
+        res = ymodem_receive(buf);
+        if (res != 0) {
             printf("ymodem_receive() failed\n");
         }
     } else {
         ymodem_context ctx;
         uint8_t buf[MODEM_XFER_BUF_SIZE];
-        int fd;
-        int res;
 
-        tx_error_rate = 500;
-        rx_error_rate = 100;
+        tx_error_rate = 0 <= error_rate ? error_rate : 500;
+        rx_error_rate = 0 <= error_rate ? error_rate : 100;
         ymodem_send_init(&ctx, buf);
+        #ifdef MODEM_XFER_FEC
+        ymodem_set_fec(&ctx, fec_parity);
+        #endif
+        if (0 <= cancel_after_ms) {
+            // cancel asynchronously and measure how long the engine takes to give up
+            pthread_t thread;
+            atexit(report_cancel_latency);
+            pthread_create(&thread, NULL, cancel_thread, &ctx);
+        }
+        if (use_delta) {
+            static uint8_t sigs[YMODEM_DELTA_SIG_SIZE * 4096];
+            ymodem_send_delta_init(&ctx, sigs, sizeof(sigs));
+        }
+        if (pack_name != NULL) {
+            res = send_pack(&ctx, send_files, num_send_files);
+            if (res != MODEM_XFER_RES_OK) {
+                printf("send_pack() failed, %d\n", res);
+                exit(1);
+            }
+            num_send_files = 0;
+        }
         for (i = 0; i < num_send_files; i++) {
             if (stat(send_files[i], &statbuf) != 0) {
                 printf("can't get status of %s\n", av[i]);
@@ -305,11 +586,33 @@ int main(int ac, char *av[])
             } else {
                 file_name = send_files[i];
             }
+            if (use_frame_cache) {
+                res = send_cached_file(&ctx, fd, file_name, (uint32_t)statbuf.st_size);
+                if (res != MODEM_XFER_RES_OK) {
+                    printf("send_cached_file() failed, %d\n", res);
+                    exit(1);
+                }
+                close(fd);
+                continue;
+            }
             res = ymodem_send_header(&ctx, file_name, (uint32_t)statbuf.st_size);
             if (res != MODEM_XFER_RES_OK) {
                 printf("ymodem_send_header() failed, %d\n", res);
                 exit(1);
             }
+            if (use_delta) {
+                uint8_t chunk[YMODEM_DELTA_CHUNK];
+                int n;
+                while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+                    res = ymodem_send_delta_chunk(&ctx, chunk, n);
+                    if (res != MODEM_XFER_RES_OK) {
+                        printf("ymodem_send_delta_chunk() failed, %d\n", res);
+                        exit(1);
+                    }
+                }
+                close(fd);
+                continue;
+            }
             uint32_t xfer_size = 0;
             while (xfer_size < (uint32_t)statbuf.st_size) {
                 int n = read(fd, buf, MODEM_XFER_BUF_SIZE);
@@ -333,6 +636,30 @@ int main(int ac, char *av[])
         }
     }
     close_port();
+    if (0 <= capture_fd) {
+        if (modem_xfer_capture_flush(&capture) != MODEM_XFER_RES_OK) {
+            printf("capture failed\n");
+        }
+        close(capture_fd);
+    }
+    if (0 <= replay_fd) {
+        printf("replayed %lu ms, %lu tx mismatch(es)\n", (unsigned long)replay.now,
+               (unsigned long)replay.num_tx_mismatches);
+        close(replay_fd);
+    }
+    #ifdef MODEM_XFER_TRACE
+    if (trace_name != NULL) {
+        int fd = open(trace_name, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+        if (fd < 0 || modem_xfer_trace_save(capture_write, &fd) != MODEM_XFER_RES_OK) {
+            printf("can't save the trace to %s\n", trace_name);
+        }
+        if (0 <= fd) {
+            close(fd);
+        }
+    } else {
+        modem_xfer_trace_dump();
+    }
+    #endif
 
-    return 0;
+    return res == 0 ? 0 : 1;
 }
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Batches a receiver must unpack, and the ones it must refuse rather than
+ * write somewhere unexpected: over-long or unsafe member names and members
+ * running past the end of the container.
+ */
+
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char name[32];
+    uint32_t size;
+    uint8_t data[256];
+} pack_file;
+
+static pack_file files[4];
+static int num_files;
+static int errors;
+
+uint32_t modem_xfer_clock_ms(void)
+{
+    return 0;
+}
+
+int modem_xfer_tx(uint8_t c)
+{
+    return 1;
+}
+
+int modem_xfer_rx(uint8_t *c, int timeout_ms)
+{
+    return 0;
+}
+
+int modem_xfer_save(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    pack_file *f;
+    int i;
+
+    for (i = 0; i < num_files && strcmp(files[i].name, file_name) != 0; i++) {
+    }
+    if (i == num_files) {
+        if (num_files == sizeof(files) / sizeof(*files)) {
+            return MODEM_XFER_RES_EIO;
+        }
+        num_files++;
+        snprintf(files[i].name, sizeof(files[i].name), "%s", file_name);
+        files[i].size = 0;
+    }
+    f = &files[i];
+    if (sizeof(f->data) < offset + size) {
+        return MODEM_XFER_RES_EIO;
+    }
+    if (buf == NULL && size == 0) {
+        f->size = offset;
+        return 0;
+    }
+    memcpy(&f->data[offset], buf, size);
+    if (f->size < offset + size) {
+        f->size = offset + size;
+    }
+
+    return 0;
+}
+
+int modem_xfer_load(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    return 0;
+}
+
+void modem_xfer_printf(int log_level, const char *format, ...)
+{
+}
+
+static unsigned int entry(uint8_t *p, const char *name, uint32_t size, const char *data)
+{
+    unsigned int len = strlen(name);
+
+    p[0] = (uint8_t)len;
+    memcpy(&p[1], name, len);
+    p[1 + len + 0] = (uint8_t)(size >> 0);
+    p[1 + len + 1] = (uint8_t)(size >> 8);
+    p[1 + len + 2] = (uint8_t)(size >> 16);
+    p[1 + len + 3] = (uint8_t)(size >> 24);
+    memcpy(&p[1 + len + 4], data, strlen(data));
+
+    return 1 + len + 4 + strlen(data);
+}
+
+/*
+ * Unpack a container of one block, declared to be container_size bytes, 0 for
+ * unknown, and return what the receiver made of it at the end of the file
+ */
+static int unpack(const uint8_t *container, unsigned int n, uint32_t container_size)
+{
+    static uint8_t buf[MODEM_XFER_BUF_SIZE];
+    ymodem_context ctx;
+    int res;
+
+    num_files = 0;
+    ymodem_receive_init(&ctx, buf);
+    strcpy(ctx.file_name, "batch");
+    ctx.file_size = container_size;
+    ctx.file_offset = 0;
+    memset(&ctx.pack, 0, sizeof(ctx.pack));  // a new batch
+    memcpy(buf, container, n);
+    res = ymodem_unpack(&ctx, buf, n);
+    if (res == MODEM_XFER_RES_OK) {
+        res = ymodem_unpack_end(&ctx);
+    }
+
+    return res;
+}
+
+static void expect(const char *what, int res, int expected)
+{
+    if (res != expected) {
+        printf("%s: %d, expected %d\n", what, res, expected);
+        errors++;
+    }
+}
+
+int main(int ac, char *av[])
+{
+    uint8_t c[MODEM_XFER_BUF_SIZE];
+    unsigned int n;
+
+    n = entry(c, "a.txt", 5, "hello");
+    n += entry(&c[n], "twelve_chars", 3, "abc");
+    c[n++] = 0;
+    expect("a batch of two", unpack(c, n, n), MODEM_XFER_RES_OK);
+    if (num_files != 2 || files[0].size != 5 || memcmp(files[0].data, "hello", 5) != 0 ||
+        strcmp(files[1].name, "twelve_chars") != 0 || files[1].size != 3) {
+        printf("a batch of two: %d files\n", num_files);
+        errors++;
+    }
+    expect("a batch of unknown size", unpack(c, n, 0), MODEM_XFER_RES_OK);
+
+    // thirteen bytes would have been cut to the twelve above and overwritten them
+    n = entry(c, "twelve_chars2", 3, "abc");
+    c[n++] = 0;
+    expect("a long name", unpack(c, n, n), MODEM_XFER_RES_EPTOROCOL);
+    expect("nothing saved of it", num_files, 0);
+
+    n = entry(c, "../a", 1, "x");
+    c[n++] = 0;
+    expect("a name with a directory", unpack(c, n, n), MODEM_XFER_RES_EPTOROCOL);
+    n = entry(c, "..", 1, "x");
+    c[n++] = 0;
+    expect("the parent directory", unpack(c, n, n), MODEM_XFER_RES_EPTOROCOL);
+    n = entry(c, "a\\b", 1, "x");
+    c[n++] = 0;
+    expect("a name with a backslash", unpack(c, n, n), MODEM_XFER_RES_EPTOROCOL);
+    n = entry(c, "a.txt", 1, "x");
+    c[2] = '\0';
+    c[n++] = 0;
+    expect("a name with a NUL", unpack(c, n, n), MODEM_XFER_RES_EPTOROCOL);
+
+    n = entry(c, "a.txt", 1000, "hello");
+    c[n++] = 0;
+    expect("a member past the end", unpack(c, n, n), MODEM_XFER_RES_EPTOROCOL);
+    expect("nothing saved of it", num_files, 0);
+
+    n = entry(c, "a.txt", 5, "hello");
+    expect("a batch without its end", unpack(c, n, n), MODEM_XFER_RES_EPTOROCOL);
+
+    // the sender refuses what the receiver would
+    {
+        static uint8_t buf[MODEM_XFER_BUF_SIZE];
+        ymodem_context ctx;
+
+        ymodem_send_init(&ctx, buf);
+        ctx.flags |= YMODEM_FLAG_PACK_ACTIVE;
+        expect("sending a long name", ymodem_send_pack_file(&ctx, "twelve_chars2", 1),
+               MODEM_XFER_RES_EPTOROCOL);
+        expect("sending a name with a directory", ymodem_send_pack_file(&ctx, "d/a", 1),
+               MODEM_XFER_RES_EPTOROCOL);
+        expect("sending an empty name", ymodem_send_pack_file(&ctx, "", 1),
+               MODEM_XFER_RES_EPTOROCOL);
+    }
+
+    printf("pack: %d errors\n", errors);
+    if (errors != 0) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stress test of the frame buffer pool: threads borrow buffers, fill them
+ * with their own pattern and check that nobody else wrote into them before
+ * giving them back.
+ */
+
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NUM_BUFS 16
+#define NUM_THREADS 8
+#define HOLD_MAX 4
+
+static modem_xfer_pool pool;
+static uint8_t mem[MODEM_XFER_POOL_MEM_SIZE(NUM_BUFS, MODEM_XFER_BUF_SIZE)];
+static int num_loops = 200000;
+static int errors;
+
+static int check(uint8_t *buf, uint8_t pattern)
+{
+    int i;
+
+    for (i = 0; i < MODEM_XFER_BUF_SIZE; i++) {
+        if (buf[i] != pattern) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    long id = (long)arg;
+    modem_xfer_pool_cache cache, *cp = (id & 1) ? &cache : NULL;
+    uint8_t *held[HOLD_MAX];
+    uint8_t pattern;
+    int i, j, n;
+
+    modem_xfer_pool_cache_init(&cache, &pool);
+    for (i = 0; i < num_loops; i++) {
+        // a session borrows up to HOLD_MAX frames at once
+        for (n = 0; n < 1 + (i + id) % HOLD_MAX; n++) {
+            if ((held[n] = modem_xfer_pool_acquire(&pool, cp)) == NULL) {
+                break;
+            }
+            pattern = (uint8_t)(id * 31 + i + n);
+            memset(held[n], pattern, MODEM_XFER_BUF_SIZE);
+        }
+        for (j = n - 1; 0 <= j; j--) {
+            pattern = (uint8_t)(id * 31 + i + j);
+            if (check(held[j], pattern) != 0) {
+                __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+            }
+            modem_xfer_pool_release(&pool, cp, held[j]);
+        }
+    }
+    modem_xfer_pool_cache_flush(&cache);
+
+    return NULL;
+}
+
+int main(int ac, char *av[])
+{
+    pthread_t threads[NUM_THREADS];
+    uint8_t *bufs[NUM_BUFS + 1];
+    long i;
+    int n;
+
+    if (1 < ac) {
+        num_loops = atoi(av[1]);
+    }
+    if (modem_xfer_pool_init(&pool, mem, sizeof(mem), MODEM_XFER_BUF_SIZE) != MODEM_XFER_RES_OK ||
+        pool.num_bufs != NUM_BUFS) {
+        printf("init failed\n");
+        return 1;
+    }
+
+    // every buffer once, then nothing
+    for (n = 0; n < NUM_BUFS + 1; n++) {
+        if ((bufs[n] = modem_xfer_pool_acquire(&pool, NULL)) == NULL) {
+            break;
+        }
+    }
+    if (n != NUM_BUFS || pool.num_exhausted != 1 || pool.high_water != NUM_BUFS) {
+        printf("exhaustion: got %d buffers, %u exhausted\n", n, pool.num_exhausted);
+        return 1;
+    }
+    while (0 < n) {
+        modem_xfer_pool_release(&pool, NULL, bufs[--n]);
+    }
+    pool.high_water = 0;
+    pool.num_exhausted = 0;
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // all of them must be back on the free list
+    for (n = 0; modem_xfer_pool_acquire(&pool, NULL) != NULL; n++) {
+    }
+    printf("%d threads x %d loops: high water %u of %u, %u exhausted, %d errors\n",
+           NUM_THREADS, num_loops, pool.high_water, NUM_BUFS, pool.num_exhausted, errors);
+    if (errors != 0 || n != NUM_BUFS) {
+        printf("FAILED (%d buffers on the free list)\n", n);
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
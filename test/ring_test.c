@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stress test of the receive ring: a thread plays the UART interrupt and
+ * pushes a known byte stream as fast as it can, while the engine side pulls
+ * frames out of it with modem_xfer_recv_bytes_until(), in bulk through
+ * modem_xfer_rx_bytes() and byte by byte through modem_xfer_rx() for
+ * comparison.
+ */
+
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define RING_SIZE 1024
+#define FRAME_SIZE (3 + MODEM_XFER_BUF_SIZE + 2)
+#define BURST 16  // bytes per interrupt, as from a UART FIFO
+
+static modem_xfer_ring ring;
+static uint8_t mem[RING_SIZE];
+static uint32_t num_bytes = 16 * 1024 * 1024;
+static volatile int lossless;
+static volatile int producer_done;
+
+static uint8_t pattern(uint32_t i)
+{
+    return (uint8_t)(i ^ (i >> 8) ^ (i >> 16));
+}
+
+uint32_t modem_xfer_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int modem_xfer_rx_bytes(uint8_t *buf, int n, int timeout_ms)
+{
+    uint32_t deadline = modem_xfer_clock_ms() + timeout_ms;
+    unsigned int res;
+
+    // a port would sleep until the next interrupt instead of spinning
+    while ((res = modem_xfer_ring_drain(&ring, buf, n)) == 0 && !modem_xfer_expired(deadline)) {
+        sched_yield();
+    }
+
+    return (int)res;
+}
+
+int modem_xfer_rx(uint8_t *c, int timeout_ms)
+{
+    return modem_xfer_rx_bytes(c, 1, timeout_ms);
+}
+
+int modem_xfer_tx(uint8_t c)
+{
+    return 1;
+}
+
+void modem_xfer_printf(int log_level, const char *format, ...)
+{
+    va_list ap;
+    va_start (ap, format);
+    vprintf(format, ap);
+    va_end (ap);
+}
+
+static void *producer(void *arg)
+{
+    uint8_t burst[BURST];
+    uint32_t i, j, n;
+
+    for (i = 0; i < num_bytes; i += n) {
+        n = num_bytes - i < BURST ? num_bytes - i : BURST;
+        for (j = 0; j < n; j++) {
+            burst[j] = pattern(i + j);
+        }
+        // a lossless run stands for a link with flow control
+        while (lossless && RING_SIZE - modem_xfer_ring_count(&ring) < n) {
+            sched_yield();
+        }
+        modem_xfer_ring_put_bytes(&ring, burst, n);
+    }
+    producer_done = 1;
+
+    return NULL;
+}
+
+static int run(const char *name, int bulk)
+{
+    pthread_t thread;
+    uint8_t frame[FRAME_SIZE];
+    uint32_t i = 0, j;
+    double start;
+    int n;
+
+    modem_xfer_ring_init(&ring, mem, sizeof(mem));
+    lossless = 1;
+    producer_done = 0;
+    start = now_sec();
+    pthread_create(&thread, NULL, producer, NULL);
+    while (i < num_bytes) {
+        if (bulk) {
+            n = modem_xfer_recv_bytes_until(frame, FRAME_SIZE, modem_xfer_clock_ms() + 1000);
+        } else {
+            for (n = 0; n < FRAME_SIZE; n++) {
+                if (modem_xfer_rx_poll(&frame[n], modem_xfer_clock_ms() + 1000, NULL) != 1) {
+                    break;
+                }
+            }
+        }
+        if (n <= 0) {
+            printf("%s: timeout at %lu\n", name, (unsigned long)i);
+            return -1;
+        }
+        for (j = 0; j < (uint32_t)n; j++, i++) {
+            if (frame[j] != pattern(i)) {
+                printf("%s: %02x != %02x at %lu\n", name, frame[j], pattern(i), (unsigned long)i);
+                return -1;
+            }
+        }
+    }
+    pthread_join(thread, NULL);
+    printf("%-6s %lu bytes, %6.1f MB/s, high water %u of %u\n", name, (unsigned long)num_bytes,
+           num_bytes / (now_sec() - start) / 1e6, ring.high_water, RING_SIZE);
+
+    return 0;
+}
+
+/*
+ * Without flow control, whatever is lost must show up in num_overruns
+ */
+static int run_overrun(void)
+{
+    pthread_t thread;
+    uint8_t frame[FRAME_SIZE];
+    uint32_t received = 0;
+    int n;
+
+    modem_xfer_ring_init(&ring, mem, sizeof(mem));
+    lossless = 0;
+    producer_done = 0;
+    pthread_create(&thread, NULL, producer, NULL);
+    while (!producer_done || 0 < modem_xfer_ring_count(&ring)) {
+        n = modem_xfer_ring_drain(&ring, frame, sizeof(frame));
+        received += n;
+        if (n == 0) {
+            sched_yield();
+        }
+    }
+    pthread_join(thread, NULL);
+    printf("overrun %lu bytes received, %lu overruns, high water %u of %u\n",
+           (unsigned long)received, (unsigned long)ring.num_overruns, ring.high_water, RING_SIZE);
+    if (received + ring.num_overruns != num_bytes || ring.high_water > RING_SIZE) {
+        printf("overrun: %lu + %lu != %lu\n", (unsigned long)received,
+               (unsigned long)ring.num_overruns, (unsigned long)num_bytes);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int check_basics(void)
+{
+    uint8_t buf[RING_SIZE + 8];
+    unsigned int i;
+
+    if (modem_xfer_ring_init(&ring, mem, 1000) == MODEM_XFER_RES_OK ||
+        modem_xfer_ring_init(&ring, mem, sizeof(mem)) != MODEM_XFER_RES_OK) {
+        printf("init\n");
+        return -1;
+    }
+    // fill it up, one more is an overrun
+    for (i = 0; i < RING_SIZE; i++) {
+        if (modem_xfer_ring_put(&ring, pattern(i)) != 1) {
+            printf("put %u\n", i);
+            return -1;
+        }
+    }
+    if (modem_xfer_ring_put(&ring, 0) != 0 || ring.num_overruns != 1 ||
+        ring.high_water != RING_SIZE || modem_xfer_ring_count(&ring) != RING_SIZE) {
+        printf("full\n");
+        return -1;
+    }
+    // take some, then wrap around the end of mem
+    if (modem_xfer_ring_drain(&ring, buf, 100) != 100 ||
+        modem_xfer_ring_put_bytes(&ring, buf, 150) != 100 || ring.num_overruns != 51) {
+        printf("wrap\n");
+        return -1;
+    }
+    if (modem_xfer_ring_drain(&ring, buf, sizeof(buf)) != RING_SIZE ||
+        modem_xfer_ring_count(&ring) != 0) {
+        printf("drain\n");
+        return -1;
+    }
+    for (i = 0; i < RING_SIZE - 100; i++) {
+        if (buf[i] != pattern(100 + i) || buf[RING_SIZE - 100 + i % 100] != pattern(i % 100)) {
+            printf("data at %u\n", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int ac, char *av[])
+{
+    if (1 < ac) {
+        num_bytes = strtoul(av[1], NULL, 0);
+    }
+    if (check_basics() != 0 || run("bulk", 1) != 0 || run("byte", 0) != 0 ||
+        run_overrun() != 0) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The application that make size links the library into. It calls what an
+ * application of the profile would, so that --gc-sections drops the rest,
+ * and the library is what this image has on top of the same stub built
+ * with SIZE_STUB_BASELINE. SIZE_STUB_ALL also calls the API which no
+ * feature macro selects, such as the frame cache.
+ */
+
+#include <stddef.h>
+
+#include <modem_xfer.h>
+
+int modem_xfer_tx(uint8_t c)
+{
+    return 1;
+}
+
+int modem_xfer_rx(uint8_t *c, int timeout_ms)
+{
+    return 0;
+}
+
+#ifdef MODEM_XFER_RX_BYTES
+int modem_xfer_rx_bytes(uint8_t *buf, int n, int timeout_ms)
+{
+    return 0;
+}
+#endif
+
+int modem_xfer_save(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    return 0;
+}
+
+int modem_xfer_load(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    return 0;
+}
+
+#ifdef MODEM_XFER_DURABLE
+int modem_xfer_commit(char *file_name, uint8_t op)
+{
+    return 0;
+}
+#endif
+
+void modem_xfer_printf(int log_level, const char *format, ...)
+{
+}
+
+uint32_t modem_xfer_clock_ms(void)
+{
+    return 0;
+}
+
+// the port is part of the baseline, whether the library calls it or not
+void *volatile port[] = {
+    modem_xfer_tx, modem_xfer_rx, modem_xfer_save, modem_xfer_load, modem_xfer_printf,
+    modem_xfer_clock_ms,
+    #ifdef MODEM_XFER_RX_BYTES
+    modem_xfer_rx_bytes,
+    #endif
+    #ifdef MODEM_XFER_DURABLE
+    modem_xfer_commit,
+    #endif
+};
+
+#ifndef SIZE_STUB_BASELINE
+static ymodem_context ctx;
+static uint8_t buf[MODEM_XFER_BUF_SIZE];
+#ifdef MODEM_XFER_POOL
+static modem_xfer_pool pool;
+static uint8_t pool_mem[MODEM_XFER_POOL_MEM_SIZE(2, MODEM_XFER_BUF_SIZE)];
+#endif
+#ifdef MODEM_XFER_RING
+static modem_xfer_ring ring;
+static uint8_t ring_mem[64];
+#endif
+#ifdef SIZE_STUB_ALL
+static ymodem_frame_cache cache;
+static uint8_t cache_mem[YMODEM_FRAME_CACHE_SIZE(MODEM_XFER_BUF_SIZE)];
+#endif
+#endif  // SIZE_STUB_BASELINE
+
+int main(void)
+{
+    #ifndef SIZE_STUB_BASELINE
+    #if defined(MODEM_XFER_POOL) && !defined(MODEM_XFER_NO_RECEIVE)
+    unsigned int n;
+    #endif
+
+    #ifndef MODEM_XFER_NO_RECEIVE
+    ymodem_receive(buf);
+    #ifdef MODEM_XFER_POOL
+    modem_xfer_pool_init(&pool, pool_mem, sizeof(pool_mem), MODEM_XFER_BUF_SIZE);
+    ymodem_receive_pool(&ctx, &pool, NULL);
+    ymodem_receive_block(&ctx, &n);
+    #endif
+    #endif  // MODEM_XFER_NO_RECEIVE
+
+    #ifndef MODEM_XFER_NO_SEND
+    ymodem_send_init(&ctx, buf);
+    #ifdef MODEM_XFER_FEC
+    ymodem_set_fec(&ctx, 2);
+    #endif
+    ymodem_send_header(&ctx, "a", 1);
+    ymodem_send_block(&ctx);
+    #ifdef MODEM_XFER_DELTA
+    ymodem_send_delta_init(&ctx, buf, sizeof(buf));
+    ymodem_send_delta_chunk(&ctx, buf, 1);
+    #endif
+    #ifdef MODEM_XFER_PACK
+    ymodem_send_pack_begin(&ctx, "b", ymodem_pack_entry_size("a", 1) + 1);
+    ymodem_send_pack_file(&ctx, "a", 1);
+    ymodem_send_pack_data(&ctx, buf, 1);
+    ymodem_send_pack_end(&ctx);
+    #endif
+    #ifdef SIZE_STUB_ALL
+    ymodem_frame_cache_init(&cache, cache_mem, sizeof(cache_mem), "c", 1);
+    ymodem_frame_cache_append(&cache, buf, 1);
+    ymodem_frame_cache_finish(&cache);
+    ymodem_send_cached_file(&ctx, &cache);
+    ymodem_send_header_crc32(&ctx, "d", 1, 0);
+    ymodem_request_cancel(&ctx);
+    #endif
+    ymodem_send_end(&ctx);
+    #endif  // MODEM_XFER_NO_SEND
+
+    #ifdef MODEM_XFER_RING
+    modem_xfer_ring_init(&ring, ring_mem, sizeof(ring_mem));
+    modem_xfer_ring_put(&ring, 0);
+    modem_xfer_ring_drain(&ring, buf, sizeof(buf));
+    #endif
+    #endif  // SIZE_STUB_BASELINE
+
+    return 0;
+}
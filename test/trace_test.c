@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Stress test of the trace ring: several threads record events at once into
+ * a small ring, as contexts or interrupt handlers would, while the main thread
+ * reads them. Every event read must be whole, those of one thread must come in
+ * order, and the events read and lost must add up to those recorded.
+ */
+
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NUM_WRITERS 4
+#define CHECK_MUL 2654435761U
+
+static const char fmt[] __attribute__((section(MODEM_XFER_TRACE_SECTION), used)) =
+    "writer %lu event %lu %lx %lx\n";
+static uint32_t num_events = 1000000;
+static int writers_done;
+
+uint32_t modem_xfer_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void modem_xfer_printf(int log_level, const char *format, ...)
+{
+    va_list ap;
+
+    (void)log_level;
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+}
+
+static void *writer(void *arg)
+{
+    uint32_t w = (uint32_t)(intptr_t)arg;
+    uint32_t i;
+
+    for (i = 0; i < num_events; i++) {
+        modem_xfer_trace_record(MODEM_XFER_LOG_DEBUG, fmt, 0, 4, w, i, i * CHECK_MUL,
+                                w ^ i ^ (i * CHECK_MUL));
+    }
+    __atomic_add_fetch(&writers_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static int check(const modem_xfer_trace_event *ev, uint32_t next[NUM_WRITERS])
+{
+    uint32_t w = ev->args[0], i = ev->args[1];
+
+    if (ev->nargs != 4 || NUM_WRITERS <= w || ev->args[2] != i * CHECK_MUL ||
+        ev->args[3] != (w ^ i ^ ev->args[2])) {
+        printf("torn event: nargs %u args %08lx %08lx %08lx %08lx\n", ev->nargs,
+               (unsigned long)ev->args[0], (unsigned long)ev->args[1],
+               (unsigned long)ev->args[2], (unsigned long)ev->args[3]);
+        return 0;
+    }
+    if (i < next[w]) {
+        printf("writer %lu: event %lu after %lu\n", (unsigned long)w, (unsigned long)i,
+               (unsigned long)next[w] - 1);
+        return 0;
+    }
+    next[w] = i + 1;
+
+    return 1;
+}
+
+int main(int ac, char *av[])
+{
+    pthread_t threads[NUM_WRITERS];
+    modem_xfer_trace_event ev;
+    uint32_t next[NUM_WRITERS] = { 0 };
+    uint64_t num_read = 0, total;
+    uint32_t lost;
+    int i, done;
+
+    if (1 < ac) {
+        num_events = (uint32_t)strtoul(av[1], NULL, 0);
+    }
+    total = (uint64_t)num_events * NUM_WRITERS;
+    for (i = 0; i < NUM_WRITERS; i++) {
+        pthread_create(&threads[i], NULL, writer, (void *)(intptr_t)i);
+    }
+    do {
+        done = __atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) == NUM_WRITERS;
+        while (modem_xfer_trace_read(&ev)) {
+            if (!check(&ev, next)) {
+                exit(1);
+            }
+            num_read++;
+        }
+    } while (!done);
+    for (i = 0; i < NUM_WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    lost = modem_xfer_trace_lost();
+    printf("%llu events: %llu read, %lu lost\n", (unsigned long long)total,
+           (unsigned long long)num_read, (unsigned long)lost);
+    if (num_read + lost != total) {
+        printf("%lld events unaccounted for\n", (long long)(total - num_read - lost));
+        exit(1);
+    }
+    printf("trace ring OK\n");
+
+    return 0;
+}
@@ -0,0 +1,897 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * mxfer: send or receive files over a serial line, a pty, TCP or stdin/stdout
+ *
+ *   mxfer send [options] FILE...
+ *   mxfer recv [options]
+ */
+
+#define _GNU_SOURCE  // posix_openpt(), cfmakeraw()
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#define TX_BUF_SIZE 1024
+#define RX_BUF_SIZE 1024
+#define PROGRESS_MS 500
+
+static int tx_fd = -1;
+static int rx_fd = -1;
+static int tty_fd = -1;
+static int pty_slave = -1;
+static struct termios tty_saved;
+static int verbose = MODEM_XFER_LOG_WARNING;
+static int show_progress;
+static ymodem_context ctx;
+
+static uint8_t tx_buf[TX_BUF_SIZE];
+static unsigned int tx_len;
+static uint8_t rx_buf[RX_BUF_SIZE];
+static unsigned int rx_len, rx_pos;
+
+// the file being written, kept open across blocks
+static char save_name[MODEM_XFER_BUF_SIZE];
+static int save_fd = -1;
+static int save_new_copy;  // save_fd is the temporary file of save_name
+
+static struct {
+    char name[MODEM_XFER_BUF_SIZE];
+    uint32_t size;
+    uint32_t bytes;
+    uint32_t start_ms;
+    uint32_t last_ms;
+    uint32_t total_bytes;
+    uint32_t total_ms;
+    int num_files;
+} progress;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: mxfer send [options] FILE...\n"
+        "       mxfer recv [options]\n"
+        "link (stdin/stdout if none is given):\n"
+        "  -l, --line DEV       serial tty or pty slave\n"
+        "  -b, --baud N         line speed, also for frame deadlines (default 115200)\n"
+        "      --vmin N         VMIN of the tty (default: a frame when receiving, 1 when sending)\n"
+        "      --vtime N        VTIME of the tty in 1/10 s (default 1)\n"
+        "      --pty            create a pty and print the name of its slave\n"
+        "      --tcp HOST:PORT  connect to a TCP port\n"
+        "      --listen PORT    accept one TCP connection\n"
+        "options:\n"
+        "  -d, --dir DIR        store received files in DIR\n"
+        "      --delta          send only the chunks which differ on the receiver\n"
+        "      --fec N          Reed-Solomon parity bytes per frame offered by the sender,\n"
+        "                       or accepted at most by the receiver (default 0 and 8)\n"
+        "      --poll MS        interval of the receiver's start byte, 1 to 25000\n"
+        "      --sync POLICY    when received files reach the disk: none, file (default) or group\n"
+        "      --sync-bytes N   group: sync every N bytes (default 65536)\n"
+        "      --sync-ms MS     group: sync every MS ms\n"
+        "  -q, --quiet          no progress\n"
+        "  -v, --verbose        more messages, may be repeated\n");
+    exit(2);
+}
+
+static uint32_t clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Port of modem_xfer
+ */
+uint32_t modem_xfer_clock_ms(void)
+{
+    return clock_ms();
+}
+
+static int tx_flush(void)
+{
+    unsigned int pos = 0;
+    int n;
+
+    while (pos < tx_len) {
+        n = write(tx_fd, &tx_buf[pos], tx_len - pos);
+        if (n < 0 && errno != EINTR) {
+            tx_len = 0;
+            return -errno;
+        }
+        if (0 < n) {
+            pos += n;
+        }
+    }
+    tx_len = 0;
+
+    return 0;
+}
+
+int modem_xfer_tx(uint8_t c)
+{
+    int res;
+
+    // collect a whole frame into one write(), it goes out before the next receive
+    if (sizeof(tx_buf) <= tx_len && (res = tx_flush()) < 0) {
+        return res;
+    }
+    tx_buf[tx_len++] = c;
+
+    return 1;
+}
+
+int modem_xfer_rx(uint8_t *c, int timeout_ms)
+{
+    struct pollfd pfd;
+    int res;
+
+    if ((res = tx_flush()) < 0) {
+        return res;
+    }
+    if (rx_pos < rx_len) {
+        *c = rx_buf[rx_pos++];
+        return 1;
+    }
+    pfd.fd = rx_fd;
+    pfd.events = POLLIN;
+    res = poll(&pfd, 1, timeout_ms);
+    if (res < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+    if (res == 0) {
+        return 0;
+    }
+    // take whatever has arrived, usually the rest of the frame
+    res = read(rx_fd, rx_buf, sizeof(rx_buf));
+    if (res < 0) {
+        return errno == EINTR || errno == EAGAIN ? 0 : -errno;
+    }
+    if (res == 0) {
+        return -EPIPE;
+    }
+    rx_len = res;
+    rx_pos = 0;
+    *c = rx_buf[rx_pos++];
+
+    return 1;
+}
+
+void modem_xfer_printf(int log_level, const char *format, ...)
+{
+    va_list ap;
+
+    if (verbose < log_level) {
+        return;
+    }
+    if (show_progress) {
+        fputc('\n', stderr);
+    }
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+static void progress_update(const char *name, uint32_t size, uint32_t bytes)
+{
+    uint32_t now = clock_ms();
+    uint32_t ms;
+
+    if (strcmp(progress.name, name) != 0) {
+        snprintf(progress.name, sizeof(progress.name), "%s", name);
+        progress.size = size;
+        progress.bytes = 0;
+        progress.start_ms = now;
+        progress.last_ms = now;
+    }
+    progress.bytes = bytes;
+    if (!show_progress || (int32_t)(now - progress.last_ms) < PROGRESS_MS) {
+        return;
+    }
+    progress.last_ms = now;
+    ms = now - progress.start_ms;
+    fprintf(stderr, "\r%-12s %10lu/%lu bytes %8.1f KB/s", name, (unsigned long)bytes,
+            (unsigned long)size, ms ? bytes / 1.024 / ms : 0.0);
+}
+
+static void progress_done(void)
+{
+    uint32_t ms = clock_ms() - progress.start_ms;
+
+    if (progress.name[0] == '\0') {
+        return;
+    }
+    if (verbose >= MODEM_XFER_LOG_WARNING) {
+        fprintf(stderr, "%s%-12s %10lu bytes %6lu ms %8.1f KB/s\n", show_progress ? "\r" : "",
+                progress.name, (unsigned long)progress.bytes, (unsigned long)ms,
+                ms ? progress.bytes / 1.024 / ms : 0.0);
+    }
+    progress.total_bytes += progress.bytes;
+    progress.total_ms += ms;
+    progress.num_files++;
+    progress.name[0] = '\0';
+}
+
+static void save_close(void)
+{
+    if (0 <= save_fd) {
+        close(save_fd);
+    }
+    save_fd = -1;
+    save_new_copy = 0;
+}
+
+static void temp_name(char *buf, const char *file_name)
+{
+    snprintf(buf, MODEM_XFER_BUF_SIZE + 8, ".%s.part", file_name);
+}
+
+static int save_open(char *file_name, int new_copy)
+{
+    char tmp[MODEM_XFER_BUF_SIZE + 8];
+
+    if (save_fd < 0 || strcmp(save_name, file_name) != 0 || new_copy) {
+        save_close();
+        // names come from the peer, keep them in the current directory
+        if (!modem_xfer_name_ok(file_name)) {
+            modem_xfer_printf(MODEM_XFER_LOG_ERROR, "refuse to write '%s'\n", file_name);
+            return -EPERM;
+        }
+        if (new_copy) {
+            temp_name(tmp, file_name);
+            save_fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0664);
+        } else {
+            save_fd = open(file_name, O_RDWR | O_CREAT, 0664);
+        }
+        if (save_fd < 0) {
+            modem_xfer_printf(MODEM_XFER_LOG_ERROR, "can't open %s (errno=%d)\n", file_name,
+                              errno);
+            return -errno;
+        }
+        snprintf(save_name, sizeof(save_name), "%s", file_name);
+        save_new_copy = new_copy;
+    }
+
+    return 0;
+}
+
+int modem_xfer_save(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    int res;
+
+    if ((res = save_open(file_name, 0)) < 0) {
+        return res;
+    }
+    if (buf == NULL && size == 0) {
+        return ftruncate(save_fd, offset) == 0 ? MODEM_XFER_RES_OK : -errno;
+    }
+    if (pwrite(save_fd, buf, size, offset) != size) {
+        return -EIO;
+    }
+    progress_update(file_name, ctx.file_size, offset + size);
+
+    return MODEM_XFER_RES_OK;
+}
+
+int modem_xfer_load(char *file_name, uint32_t offset, uint8_t *buf, uint16_t size)
+{
+    int fd, res;
+
+    if (!modem_xfer_name_ok(file_name)) {
+        return -EPERM;
+    }
+    // a new copy is not the file until it is renamed, delta reads the old one
+    if (0 <= save_fd && !save_new_copy && strcmp(save_name, file_name) == 0) {
+        res = pread(save_fd, buf, size, offset);
+    } else {
+        if ((fd = open(file_name, O_RDONLY)) < 0) {
+            return 0;
+        }
+        res = pread(fd, buf, size, offset);
+        close(fd);
+    }
+
+    return res < 0 ? -EIO : res;
+}
+
+/*
+ * A new copy is written to .NAME.part, which is renamed to NAME once complete
+ */
+int modem_xfer_commit(char *file_name, uint8_t op)
+{
+    char tmp[MODEM_XFER_BUF_SIZE + 8];
+    int res = MODEM_XFER_RES_OK;
+    int fd;
+
+    if (op & MODEM_XFER_COMMIT_BEGIN) {
+        return save_open(file_name, 1) < 0 ? MODEM_XFER_RES_EIO : MODEM_XFER_RES_OK;
+    }
+    if (save_fd < 0 || strcmp(save_name, file_name) != 0) {
+        return MODEM_XFER_RES_OK;
+    }
+    if ((op & MODEM_XFER_COMMIT_SYNC) && fdatasync(save_fd) != 0) {
+        res = MODEM_XFER_RES_EIO;
+    }
+    if (!(op & (MODEM_XFER_COMMIT_END | MODEM_XFER_COMMIT_ABORT))) {
+        return res;
+    }
+    if (!save_new_copy) {
+        // written in place
+        save_close();
+        return res;
+    }
+    save_close();
+    temp_name(tmp, file_name);
+    if (res != MODEM_XFER_RES_OK || (op & MODEM_XFER_COMMIT_ABORT)) {
+        unlink(tmp);
+        return res;
+    }
+    if (rename(tmp, file_name) != 0) {
+        modem_xfer_printf(MODEM_XFER_LOG_ERROR, "can't rename %s (errno=%d)\n", tmp, errno);
+        unlink(tmp);
+        return MODEM_XFER_RES_EIO;
+    }
+    if ((op & MODEM_XFER_COMMIT_SYNC) && 0 <= (fd = open(".", O_RDONLY))) {
+        // make the rename itself durable
+        fsync(fd);
+        close(fd);
+    }
+
+    return MODEM_XFER_RES_OK;
+}
+
+/*
+ * Links
+ */
+static speed_t baud_to_speed(long baud)
+{
+    static const struct { long baud; speed_t speed; } speeds[] = {
+        { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+        { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+        { 230400, B230400 },
+        #ifdef B460800
+        { 460800, B460800 }, { 921600, B921600 }, { 1000000, B1000000 },
+        { 2000000, B2000000 }, { 3000000, B3000000 },
+        #endif
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(speeds) / sizeof(*speeds); i++) {
+        if (speeds[i].baud == baud) {
+            return speeds[i].speed;
+        }
+    }
+
+    return (speed_t)-1;
+}
+
+static void tty_restore(void)
+{
+    tx_flush();
+    if (0 <= tty_fd) {
+        tcdrain(tty_fd);
+        tcsetattr(tty_fd, TCSANOW, &tty_saved);
+    }
+}
+
+/*
+ * Closing the master hangs up the slave, and the peer loses whatever it has
+ * not read yet, such as the last ACK. Give it a moment to pick that up.
+ */
+static void pty_drain(void)
+{
+    int i, n;
+
+    for (i = 0; 0 <= pty_slave && i < 100; i++) {
+        if (ioctl(pty_slave, FIONREAD, &n) != 0 || n == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+}
+
+static int tty_setup(int fd, long baud, int vmin, int vtime)
+{
+    struct termios tio;
+    speed_t speed;
+
+    if (tcgetattr(fd, &tio) != 0) {
+        return -errno;
+    }
+    if (tty_fd < 0) {
+        tty_fd = fd;
+        tty_saved = tio;
+        atexit(tty_restore);
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    // one read() per frame instead of one per byte, VTIME ends it at the gap after the frame
+    tio.c_cc[VMIN] = vmin;
+    tio.c_cc[VTIME] = vtime;
+    if (0 < baud) {
+        if ((speed = baud_to_speed(baud)) == (speed_t)-1) {
+            fprintf(stderr, "unsupported baud rate %ld\n", baud);
+            return -EINVAL;
+        }
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+    if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+        return -errno;
+    }
+    tcflush(fd, TCIOFLUSH);
+
+    #if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+    {
+        // don't let the driver hold received bytes back, ptys and USB adapters may refuse
+        struct serial_struct ss;
+        if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+            ss.flags |= ASYNC_LOW_LATENCY;
+            ioctl(fd, TIOCSSERIAL, &ss);
+        }
+    }
+    #endif
+
+    return 0;
+}
+
+static int open_line(const char *dev, long baud, int vmin, int vtime)
+{
+    int fd = open(dev, O_RDWR | O_NOCTTY);
+
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s (errno=%d)\n", dev, errno);
+        return -1;
+    }
+    if (tty_setup(fd, baud, vmin, vtime) != 0) {
+        fprintf(stderr, "%s is not a usable tty\n", dev);
+        return -1;
+    }
+    tx_fd = rx_fd = fd;
+
+    return 0;
+}
+
+static int open_pty(int vmin, int vtime)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    int slave;
+
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        fprintf(stderr, "can't create a pty (errno=%d)\n", errno);
+        return -1;
+    }
+    // keep the slave open so that the master doesn't see EIO before the peer opens it
+    slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    if (slave < 0 || tty_setup(slave, 0, vmin, vtime) != 0) {
+        fprintf(stderr, "can't set up %s\n", ptsname(fd));
+        return -1;
+    }
+    // the peer shares the slave termios, restoring it on exit would make it canonical again
+    tty_fd = -1;
+    pty_slave = slave;
+    fprintf(stderr, "pty %s\n", ptsname(fd));
+    tx_fd = rx_fd = fd;
+
+    return 0;
+}
+
+static int open_tcp(char *host_port, int listen_port)
+{
+    struct addrinfo hints, *ai;
+    int fd, one = 1;
+    char *port;
+
+    if (0 < listen_port) {
+        struct sockaddr_in addr;
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(listen_port);
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 1) != 0) {
+            fprintf(stderr, "can't listen on port %d (errno=%d)\n", listen_port, errno);
+            return -1;
+        }
+        fd = accept(listen_fd, NULL, NULL);
+        close(listen_fd);
+    } else {
+        port = strrchr(host_port, ':');
+        if (port == NULL) {
+            fprintf(stderr, "--tcp requires HOST:PORT\n");
+            return -1;
+        }
+        *port++ = '\0';
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host_port, port, &hints, &ai) != 0) {
+            fprintf(stderr, "unknown host %s\n", host_port);
+            return -1;
+        }
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (0 <= fd && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(ai);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "can't connect (errno=%d)\n", errno);
+        return -1;
+    }
+    // ACKs are single bytes, don't let Nagle hold them back
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    tx_fd = rx_fd = fd;
+
+    return 0;
+}
+
+static void on_signal(int sig)
+{
+    // the engine notices within MODEM_XFER_POLL_MS and sends CAN CAN
+    ymodem_request_cancel(&ctx);
+}
+
+/*
+ * Transfers
+ */
+static int send_file(char *path, int use_delta)
+{
+    struct stat st;
+    uint8_t chunk[YMODEM_DELTA_CHUNK];
+    uint32_t offset = 0, crc = 0;
+    char *file_name;
+    int fd, n, res;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "can't read %s\n", path);
+        if (0 <= fd) {
+            close(fd);
+        }
+        return -EIO;
+    }
+    #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+    file_name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    if (use_delta) {
+        // a receiver without SHA-256 signatures takes a delta only with the crc32
+        while (0 < (n = read(fd, chunk, sizeof(chunk)))) {
+            crc = modem_xfer_crc32(crc, chunk, n);
+        }
+        if (n < 0 || lseek(fd, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "can't read %s\n", path);
+            close(fd);
+            return -EIO;
+        }
+        res = ymodem_send_header_crc32(&ctx, file_name, (uint32_t)st.st_size, crc);
+    } else {
+        res = ymodem_send_header(&ctx, file_name, (uint32_t)st.st_size);
+    }
+    progress_update(file_name, (uint32_t)st.st_size, 0);
+    while (res == MODEM_XFER_RES_OK && offset < (uint32_t)st.st_size) {
+        if (use_delta) {
+            n = read(fd, chunk, sizeof(chunk));
+            res = n <= 0 ? -EIO : ymodem_send_delta_chunk(&ctx, chunk, n);
+        } else {
+            n = read(fd, ctx.buf, MODEM_XFER_BUF_SIZE);
+            if (n <= 0) {
+                res = -EIO;
+                break;
+            }
+            // pad the last block with ^Z as sz does
+            memset(&ctx.buf[n], 0x1a, MODEM_XFER_BUF_SIZE - n);
+            res = ymodem_send_block(&ctx);
+        }
+        offset += n;
+        progress_update(file_name, (uint32_t)st.st_size, offset);
+    }
+    close(fd);
+    if (res == MODEM_XFER_RES_OK) {
+        progress_done();
+    }
+
+    return res;
+}
+
+static int do_send(char *files[], int num_files, int use_delta)
+{
+    static uint8_t sigs[YMODEM_DELTA_SIG_SIZE * 16384];
+    int i, res = MODEM_XFER_RES_OK;
+
+    if (use_delta) {
+        ymodem_send_delta_init(&ctx, sigs, sizeof(sigs));
+    }
+    for (i = 0; i < num_files && res == MODEM_XFER_RES_OK; i++) {
+        res = send_file(files[i], use_delta);
+    }
+    if (res == MODEM_XFER_RES_OK) {
+        res = ymodem_send_end(&ctx);
+    } else {
+        ymodem_send_cancel(&ctx);
+    }
+
+    return res;
+}
+
+static int do_recv(void)
+{
+    unsigned int n;
+    int res;
+
+    ctx.flags |= YMODEM_FLAG_EOF_BLOCK | YMODEM_FLAG_DELTA | YMODEM_FLAG_PACK;
+    while ((res = ymodem_receive_block(&ctx, &n)) == MODEM_XFER_RES_OK) {
+        if (ctx.file_name[0] == '\0') {
+            break;
+        }
+        if (n == 0) {
+            // end of file, an older copy might have been longer
+            if (!(ctx.flags & YMODEM_FLAG_PACK_ACTIVE) && ctx.file_size != 0 &&
+                modem_xfer_save(ctx.file_name, ctx.file_size, NULL, 0) != MODEM_XFER_RES_OK) {
+                res = MODEM_XFER_RES_EIO;
+                break;
+            }
+            if ((ctx.flags & YMODEM_FLAG_PACK_ACTIVE) && (res = ymodem_unpack_end(&ctx)) != 0) {
+                break;
+            }
+            if (ctx.digest_stat == YMODEM_DIGEST_MISMATCH) {
+                res = MODEM_XFER_RES_EIO;
+                break;
+            }
+            if ((res = ymodem_commit(&ctx, 0)) != MODEM_XFER_RES_OK) {
+                break;
+            }
+            progress_done();
+            continue;
+        }
+        if (ctx.flags & YMODEM_FLAG_PACK_ACTIVE) {
+            res = ymodem_unpack(&ctx, ctx.buf, n);
+        } else {
+            res = modem_xfer_save(ctx.file_name, ctx.file_offset, ctx.buf, n);
+        }
+        if (res == MODEM_XFER_RES_OK) {
+            res = ymodem_commit(&ctx, n);
+        }
+        if (res != MODEM_XFER_RES_OK) {
+            break;
+        }
+    }
+    if (res != MODEM_XFER_RES_OK) {
+        ymodem_send_cancel(&ctx);
+    }
+    // a file which didn't make it leaves the old copy alone
+    ymodem_commit_abort(&ctx);
+    save_close();
+
+    return res;
+}
+
+static long int_arg(int ac, char *av[], int i)
+{
+    char *p;
+    long v;
+
+    if (ac <= i + 1) {
+        usage();
+    }
+    v = strtol(av[i + 1], &p, 0);
+    if (*p != '\0' || v < 0) {
+        usage();
+    }
+
+    return v;
+}
+
+int main(int ac, char *av[])
+{
+    uint8_t buf[MODEM_XFER_BUF_SIZE];
+    char *line = NULL, *tcp = NULL, *dir = NULL;
+    long baud = 115200, listen_port = 0, poll_ms = 0, sync_bytes = -1, sync_ms = 0, fec = -1;
+    int sync_policy = YMODEM_SYNC_FILE;
+    int vmin = -1, vtime = 1, use_pty = 0, use_delta = 0, quiet = 0;
+    int sending, i, res;
+    uint32_t start_ms;
+
+    if (ac < 2 || (strcmp(av[1], "send") != 0 && strcmp(av[1], "recv") != 0)) {
+        usage();
+    }
+    sending = strcmp(av[1], "send") == 0;
+    for (i = 2; i < ac && av[i][0] == '-'; i++) {
+        if (strcmp(av[i], "-l") == 0 || strcmp(av[i], "--line") == 0) {
+            if (ac <= i + 1) {
+                usage();
+            }
+            line = av[++i];
+        } else
+        if (strcmp(av[i], "-b") == 0 || strcmp(av[i], "--baud") == 0) {
+            baud = int_arg(ac, av, i++);
+        } else
+        if (strcmp(av[i], "--vmin") == 0) {
+            vmin = int_arg(ac, av, i++);
+        } else
+        if (strcmp(av[i], "--vtime") == 0) {
+            vtime = int_arg(ac, av, i++);
+        } else
+        if (strcmp(av[i], "--pty") == 0) {
+            use_pty = 1;
+        } else
+        if (strcmp(av[i], "--tcp") == 0) {
+            if (ac <= i + 1) {
+                usage();
+            }
+            tcp = av[++i];
+        } else
+        if (strcmp(av[i], "--listen") == 0) {
+            listen_port = int_arg(ac, av, i++);
+        } else
+        if (strcmp(av[i], "-d") == 0 || strcmp(av[i], "--dir") == 0) {
+            if (ac <= i + 1) {
+                usage();
+            }
+            dir = av[++i];
+        } else
+        if (strcmp(av[i], "--delta") == 0) {
+            use_delta = 1;
+        } else
+        if (strcmp(av[i], "--poll") == 0) {
+            poll_ms = int_arg(ac, av, i++);
+            if (poll_ms == 0 || MODEM_XFER_REQ_WAIT_MS < poll_ms) {
+                usage();
+            }
+        } else
+        if (strcmp(av[i], "--fec") == 0) {
+            fec = int_arg(ac, av, i++);
+            if (YMODEM_FEC_MAX_PARITY < fec) {
+                usage();
+            }
+        } else
+        if (strcmp(av[i], "--sync") == 0) {
+            if (ac <= i + 1) {
+                usage();
+            }
+            i++;
+            if (strcmp(av[i], "none") == 0) {
+                sync_policy = YMODEM_SYNC_NONE;
+            } else
+            if (strcmp(av[i], "file") == 0) {
+                sync_policy = YMODEM_SYNC_FILE;
+            } else
+            if (strcmp(av[i], "group") == 0) {
+                sync_policy = YMODEM_SYNC_GROUP;
+            } else {
+                usage();
+            }
+        } else
+        if (strcmp(av[i], "--sync-bytes") == 0) {
+            sync_bytes = int_arg(ac, av, i++);
+        } else
+        if (strcmp(av[i], "--sync-ms") == 0) {
+            sync_ms = int_arg(ac, av, i++);
+        } else
+        if (strcmp(av[i], "-q") == 0 || strcmp(av[i], "--quiet") == 0) {
+            quiet = 1;
+        } else
+        if (strcmp(av[i], "-v") == 0 || strcmp(av[i], "--verbose") == 0) {
+            verbose++;
+        } else {
+            usage();
+        }
+    }
+    if (sending ? i == ac : i != ac) {
+        usage();
+    }
+    if (vmin < 0) {
+        // a receiver reads frames, a sender mostly single byte answers
+        vmin = sending ? 1 : (MODEM_XFER_BUF_SIZE + 5 < 255 ? MODEM_XFER_BUF_SIZE + 5 : 255);
+    }
+
+    if (line != NULL) {
+        res = open_line(line, baud, vmin, vtime);
+    } else
+    if (use_pty) {
+        res = open_pty(vmin, vtime);
+    } else
+    if (tcp != NULL || 0 < listen_port) {
+        res = open_tcp(tcp, (int)listen_port);
+    } else {
+        rx_fd = 0;
+        tx_fd = 1;
+        res = isatty(0) ? tty_setup(0, 0, vmin, vtime) : 0;
+    }
+    if (res != 0) {
+        exit(1);
+    }
+    if (dir != NULL && chdir(dir) != 0) {
+        fprintf(stderr, "can't change directory to %s\n", dir);
+        exit(1);
+    }
+    show_progress = !quiet && isatty(2) && verbose <= MODEM_XFER_LOG_WARNING;
+    if (quiet) {
+        verbose = MODEM_XFER_LOG_ERROR;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    start_ms = clock_ms();
+    if (sending) {
+        ymodem_send_init(&ctx, buf);
+    } else {
+        ymodem_receive_init(&ctx, buf);
+        if (0 < poll_ms) {
+            ctx.poll_ms = (uint16_t)poll_ms;
+        }
+        if (sync_bytes < 0) {
+            sync_bytes = sync_ms ? 0 : 65536;
+        }
+        ymodem_set_sync(&ctx, sync_policy, (uint32_t)sync_bytes, (uint16_t)sync_ms);
+    }
+    if (0 <= fec) {
+        ymodem_set_fec(&ctx, (uint8_t)fec);
+    }
+    // frame deadlines follow the line speed; a pty, a socket or a pipe is as
+    // fast as the default, and not the 300 baud the library assumes
+    ctx.baud = (uint32_t)baud;
+    res = sending ? do_send(&av[i], ac - i, use_delta) : do_recv();
+    tx_flush();
+    pty_drain();
+    if (res != MODEM_XFER_RES_OK) {
+        fprintf(stderr, "\ntransfer failed (%d)\n", res);
+        exit(1);
+    }
+    if (!quiet) {
+        uint32_t ms = clock_ms() - start_ms;
+        fprintf(stderr, "%d file%s, %lu bytes in %lu ms, %.1f KB/s\n", progress.num_files,
+                progress.num_files == 1 ? "" : "s", (unsigned long)progress.total_bytes,
+                (unsigned long)ms, ms ? progress.total_bytes / 1.024 / ms : 0.0);
+    }
+
+    return 0;
+}
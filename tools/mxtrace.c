@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2023 @hanyazou
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * mxtrace: render a trace saved by modem_xfer_trace_save()
+ *
+ *   mxtrace FORMATS TRACE
+ *
+ * FORMATS is the format table of the image which recorded the trace:
+ *
+ *   objcopy -O binary --only-section=modem_xfer_trace_fmt image FORMATS
+ */
+
+#include <modem_xfer.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *level_names[] = { "E", "W", "I", "D", "V" };
+
+static uint8_t *read_file(const char *name, uint32_t *size)
+{
+    FILE *fp = fopen(name, "rb");
+    uint8_t *buf = NULL;
+    long n;
+
+    if (fp == NULL) {
+        fprintf(stderr, "can't open %s\n", name);
+        exit(1);
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (n = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0 ||
+        (buf = malloc(n + 1)) == NULL || fread(buf, 1, n, fp) != (size_t)n) {
+        fprintf(stderr, "can't read %s\n", name);
+        exit(1);
+    }
+    fclose(fp);
+    *size = (uint32_t)n;
+
+    return buf;
+}
+
+int main(int ac, char *av[])
+{
+    modem_xfer_trace_event ev;
+    uint8_t *fmts, *trace, *p;
+    uint32_t fmts_size, trace_size, lost;
+    char line[256];
+
+    if (ac != 3) {
+        fprintf(stderr, "usage: %s FORMATS TRACE\n", av[0]);
+        return 2;
+    }
+    fmts = read_file(av[1], &fmts_size);
+    trace = read_file(av[2], &trace_size);
+    if (trace_size < MODEM_XFER_TRACE_HEADER_SIZE || memcmp(trace, "MXT1", 4) != 0) {
+        fprintf(stderr, "%s is not a trace\n", av[2]);
+        return 1;
+    }
+    if (trace[8] != MODEM_XFER_TRACE_ARGS || trace[9] != MODEM_XFER_TRACE_STR) {
+        fprintf(stderr, "%s has %u args and %u string bytes per event, "
+                "rebuild with -DMODEM_XFER_TRACE_STR=%u\n", av[2], trace[8], trace[9], trace[9]);
+        return 1;
+    }
+    lost = trace[4] | trace[5] << 8 | trace[6] << 16 | (uint32_t)trace[7] << 24;
+    if (lost) {
+        printf("trace: %lu event(s) lost\n", (unsigned long)lost);
+    }
+
+    for (p = &trace[MODEM_XFER_TRACE_HEADER_SIZE];
+         p + MODEM_XFER_TRACE_EVENT_SIZE <= &trace[trace_size]; p += MODEM_XFER_TRACE_EVENT_SIZE) {
+        if (modem_xfer_trace_decode(p, &ev) != MODEM_XFER_RES_OK) {
+            fprintf(stderr, "broken event at %lu\n", (unsigned long)(p - trace));
+            return 1;
+        }
+        modem_xfer_trace_format((const char *)fmts, fmts_size, &ev, line, sizeof(line));
+        printf("[%8lu] %s %s", (unsigned long)ev.timestamp,
+               ev.log_level < sizeof(level_names) / sizeof(*level_names) ?
+               level_names[ev.log_level] : "?", line);
+    }
+    if (p != &trace[trace_size]) {
+        fprintf(stderr, "%s: %lu trailing byte(s)\n", av[2], (unsigned long)(&trace[trace_size] - p));
+        return 1;
+    }
+
+    return 0;
+}